@@ -0,0 +1,67 @@
+#ifndef __JOINT_STREAM_LAYOUT_H__
+#define __JOINT_STREAM_LAYOUT_H__
+
+/* Layout of the POSIX shared memory object the player publishes the
+   tracked joints to. It only uses fixed size types so that consumers
+   can map it without GLib or Skeltrack.
+
+   The object starts with a JointStreamHeader followed by n_slots
+   JointStreamSlot. Pose number n (counting from 0) goes to slot
+   n % n_slots, whose sequence is odd while it is written and 2 * n + 2
+   once it holds that pose. head is the number of poses published.
+
+   To read pose n a consumer loads the slot sequence (acquire), copies
+   the slot, and loads the sequence again after an acquire fence: the
+   copy is good if both equal 2 * n + 2. A larger sequence means the
+   producer already overwrote the slot and the reader fell behind. */
+
+#include <stdint.h>
+
+#define JOINT_STREAM_MAGIC   0x534a4b53 /* "SKJS" */
+#define JOINT_STREAM_VERSION 1
+
+#define JOINT_STREAM_SLOTS   256
+
+/* Same order as SkeltrackJointId */
+#define JOINT_STREAM_JOINTS  7
+
+typedef struct
+{
+  /* World coordinates in millimeters */
+  int32_t x;
+  int32_t y;
+  int32_t z;
+  /* Position in the frame, in pixels */
+  int32_t screen_x;
+  int32_t screen_y;
+  /* Zero if the joint was not found */
+  int32_t valid;
+} JointStreamJoint;
+
+typedef struct
+{
+  uint64_t sequence;
+  /* Monotonic clock, CLOCK_MONOTONIC on Linux, in microseconds, when
+     the pose was published */
+  int64_t timestamp;
+  /* Index of the frame in its recording and of the recording in the
+     player command line */
+  uint32_t frame_index;
+  uint32_t session;
+  JointStreamJoint joints[JOINT_STREAM_JOINTS];
+} JointStreamSlot;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_slots;
+  uint32_t slot_size;
+  uint64_t head;
+  uint8_t padding[40];
+} JointStreamHeader;
+
+#define JOINT_STREAM_SIZE(n_slots) \
+  (sizeof (JointStreamHeader) + (n_slots) * sizeof (JointStreamSlot))
+
+#endif /* __JOINT_STREAM_LAYOUT_H__ */
@@ -0,0 +1,262 @@
+/* Reference consumer of the joint stream published by video-player
+   --joint-stream. It prints every pose published after it started, or
+   with -l measures how long after publication each pose was read.
+
+   It only needs joint-stream-layout.h and POSIX, and busy waits for new
+   poses so that they are picked up as soon as they are published. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "joint-stream-layout.h"
+
+#define DEFAULT_LATENCY_POSES 1000
+
+static const char *joint_names[JOINT_STREAM_JOINTS] =
+{
+  "head",
+  "left-shoulder",
+  "right-shoulder",
+  "left-elbow",
+  "right-elbow",
+  "left-hand",
+  "right-hand"
+};
+
+static int64_t
+monotonic_time (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Copies pose @n to @out. Returns 0 on success, -1 if it has not been
+   published yet and 1 if its slot was already reused. */
+static int
+read_pose (const JointStreamHeader *stream, uint64_t n, JointStreamSlot *out)
+{
+  const JointStreamSlot *slot;
+  uint64_t expected = n * 2 + 2;
+  uint64_t before, after;
+
+  slot = (const JointStreamSlot *) (stream + 1) + n % stream->n_slots;
+
+  before = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE);
+  if (before != expected)
+    return before < expected ? -1 : 1;
+
+  memcpy (out, slot, sizeof (JointStreamSlot));
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  after = __atomic_load_n (&slot->sequence, __ATOMIC_RELAXED);
+
+  return after == expected ? 0 : 1;
+}
+
+static void
+print_pose (const JointStreamSlot *pose, int64_t latency)
+{
+  int i;
+
+  printf ("session %u frame %u latency %lld us\n",
+          pose->session, pose->frame_index, (long long) latency);
+
+  for (i = 0; i < JOINT_STREAM_JOINTS; i++)
+    {
+      const JointStreamJoint *joint = &pose->joints[i];
+
+      if (! joint->valid)
+        continue;
+
+      printf ("  %s %d %d %d screen %d %d\n", joint_names[i],
+              joint->x, joint->y, joint->z,
+              joint->screen_x, joint->screen_y);
+    }
+
+  fflush (stdout);
+}
+
+static int
+compare_latencies (const void *a, const void *b)
+{
+  int64_t latency_a = *(const int64_t *) a;
+  int64_t latency_b = *(const int64_t *) b;
+
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static void
+print_latencies (int64_t *latencies, unsigned long count,
+                 unsigned long dropped)
+{
+  double total = 0;
+  unsigned long i;
+
+  qsort (latencies, count, sizeof (int64_t), compare_latencies);
+  for (i = 0; i < count; i++)
+    total += latencies[i];
+
+  printf ("poses %lu dropped %lu\n", count, dropped);
+  printf ("latency us min %lld mean %.1f p50 %lld p99 %lld max %lld\n",
+          (long long) latencies[0],
+          total / count,
+          (long long) latencies[count / 2],
+          (long long) latencies[count * 99 / 100],
+          (long long) latencies[count - 1]);
+}
+
+static const JointStreamHeader *
+open_stream (const char *name)
+{
+  char path[256];
+  const JointStreamHeader *stream;
+  struct stat info;
+  void *data;
+  int fd;
+
+  snprintf (path, sizeof (path), "%s%s", name[0] == '/' ? "" : "/", name);
+
+  fd = shm_open (path, O_RDONLY, 0);
+  if (fd < 0)
+    {
+      perror (path);
+      return NULL;
+    }
+
+  if (fstat (fd, &info) < 0 || info.st_size < sizeof (JointStreamHeader))
+    {
+      fprintf (stderr, "%s: not a joint stream\n", path);
+      close (fd);
+      return NULL;
+    }
+
+  data = mmap (NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      perror (path);
+      return NULL;
+    }
+
+  stream = (const JointStreamHeader *) data;
+  if (__atomic_load_n (&stream->magic, __ATOMIC_ACQUIRE) != JOINT_STREAM_MAGIC ||
+      stream->version != JOINT_STREAM_VERSION ||
+      stream->slot_size != sizeof (JointStreamSlot) ||
+      info.st_size < JOINT_STREAM_SIZE (stream->n_slots))
+    {
+      fprintf (stderr, "%s: not a joint stream of version %d\n",
+               path, JOINT_STREAM_VERSION);
+      munmap (data, info.st_size);
+      return NULL;
+    }
+
+  return stream;
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr,
+           "Usage: %s [-l] [-n COUNT] NAME\n"
+           "  -l        only report the latency of COUNT poses (default %d)\n"
+           "  -n COUNT  exit after COUNT poses\n",
+           program, DEFAULT_LATENCY_POSES);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const JointStreamHeader *stream;
+  JointStreamSlot pose;
+  int64_t *latencies = NULL;
+  unsigned long count = 0, limit = 0, dropped = 0;
+  uint64_t next;
+  int latency_only = 0;
+  int option;
+
+  while ((option = getopt (argc, argv, "ln:")) != -1)
+    {
+      switch (option)
+        {
+        case 'l':
+          latency_only = 1;
+          break;
+        case 'n':
+          limit = strtoul (optarg, NULL, 10);
+          break;
+        default:
+          usage (argv[0]);
+          return 1;
+        }
+    }
+
+  if (optind != argc - 1)
+    {
+      usage (argv[0]);
+      return 1;
+    }
+
+  stream = open_stream (argv[optind]);
+  if (stream == NULL)
+    return 1;
+
+  if (latency_only)
+    {
+      if (limit == 0)
+        limit = DEFAULT_LATENCY_POSES;
+      latencies = malloc (limit * sizeof (int64_t));
+    }
+
+  /* Only poses published from now on */
+  next = __atomic_load_n (&stream->head, __ATOMIC_ACQUIRE);
+
+  while (limit == 0 || count < limit)
+    {
+      int64_t latency;
+      uint64_t head;
+
+      switch (read_pose (stream, next, &pose))
+        {
+        case -1:
+          sched_yield ();
+          continue;
+        case 1:
+          /* Fell a whole ring behind, go on from the oldest pose that
+             is still there */
+          head = __atomic_load_n (&stream->head, __ATOMIC_ACQUIRE);
+          dropped += head - stream->n_slots + 1 - next;
+          next = head - stream->n_slots + 1;
+          continue;
+        }
+
+      latency = monotonic_time () - pose.timestamp;
+      next++;
+
+      if (latency_only)
+        latencies[count] = latency;
+      else
+        print_pose (&pose, latency);
+      count++;
+    }
+
+  if (latency_only)
+    {
+      print_latencies (latencies, count, dropped);
+      free (latencies);
+    }
+
+  return 0;
+}
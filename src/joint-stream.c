@@ -0,0 +1,146 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "joint-stream.h"
+
+G_STATIC_ASSERT (JOINT_STREAM_JOINTS == SKELTRACK_JOINT_MAX_JOINTS);
+G_STATIC_ASSERT (sizeof (JointStreamHeader) == 64);
+
+/* Tracking runs on several threads, they take turns here so that the
+   ring only ever has a single writer */
+static GMutex joint_stream_lock;
+static JointStreamHeader *joint_stream = NULL;
+static gchar *joint_stream_name = NULL;
+
+gboolean
+joint_stream_open (const gchar *name, GError **error)
+{
+  gsize size = JOINT_STREAM_SIZE (JOINT_STREAM_SLOTS);
+  gpointer data;
+  gint saved_errno;
+  gint fd;
+
+  /* shm_open () wants a single leading slash */
+  if (name[0] == '/')
+    joint_stream_name = g_strdup (name);
+  else
+    joint_stream_name = g_strconcat ("/", name, NULL);
+
+  /* A stream left behind by an earlier run is replaced, readers still
+     mapping it just stop seeing new poses */
+  shm_unlink (joint_stream_name);
+  fd = shm_open (joint_stream_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    goto error;
+
+  if (ftruncate (fd, size) < 0)
+    {
+      saved_errno = errno;
+      close (fd);
+      shm_unlink (joint_stream_name);
+      errno = saved_errno;
+      goto error;
+    }
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  saved_errno = errno;
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      shm_unlink (joint_stream_name);
+      errno = saved_errno;
+      goto error;
+    }
+
+  /* The object is new, so every slot sequence is already 0 */
+  joint_stream = (JointStreamHeader *) data;
+  joint_stream->version = JOINT_STREAM_VERSION;
+  joint_stream->n_slots = JOINT_STREAM_SLOTS;
+  joint_stream->slot_size = sizeof (JointStreamSlot);
+  __atomic_store_n (&joint_stream->magic, JOINT_STREAM_MAGIC,
+                    __ATOMIC_RELEASE);
+
+  return TRUE;
+
+ error:
+  saved_errno = errno;
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "%s: %s", joint_stream_name, g_strerror (saved_errno));
+  g_free (joint_stream_name);
+  joint_stream_name = NULL;
+
+  return FALSE;
+}
+
+void
+joint_stream_publish (guint session, guint frame_index,
+                      SkeltrackJointList pose)
+{
+  JointStreamSlot *slot;
+  guint64 head;
+  gint i;
+
+  if (joint_stream == NULL)
+    return;
+
+  g_mutex_lock (&joint_stream_lock);
+
+  head = joint_stream->head;
+  slot = (JointStreamSlot *) (joint_stream + 1) + head % JOINT_STREAM_SLOTS;
+
+  /* Readers that catch the slot from here on see an odd sequence, or a
+     changed one once they are done copying, and drop what they read */
+  __atomic_store_n (&slot->sequence, head * 2 + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  slot->frame_index = frame_index;
+  slot->session = session;
+  for (i = 0; i < JOINT_STREAM_JOINTS; i++)
+    {
+      JointStreamJoint *out = &slot->joints[i];
+      SkeltrackJoint *joint = NULL;
+
+      if (pose != NULL)
+        joint = skeltrack_joint_list_get_joint (pose, i);
+
+      if (joint == NULL)
+        {
+          memset (out, 0, sizeof (JointStreamJoint));
+          continue;
+        }
+
+      out->x = joint->x;
+      out->y = joint->y;
+      out->z = joint->z;
+      out->screen_x = joint->screen_x;
+      out->screen_y = joint->screen_y;
+      out->valid = 1;
+    }
+  slot->timestamp = g_get_monotonic_time ();
+
+  __atomic_store_n (&slot->sequence, head * 2 + 2, __ATOMIC_RELEASE);
+  __atomic_store_n (&joint_stream->head, head + 1, __ATOMIC_RELEASE);
+
+  g_mutex_unlock (&joint_stream_lock);
+}
+
+void
+joint_stream_close (void)
+{
+  if (joint_stream == NULL)
+    return;
+
+  munmap (joint_stream, JOINT_STREAM_SIZE (JOINT_STREAM_SLOTS));
+  shm_unlink (joint_stream_name);
+  g_free (joint_stream_name);
+  joint_stream = NULL;
+  joint_stream_name = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef __JOINT_STREAM_H__
+#define __JOINT_STREAM_H__
+
+#include <glib.h>
+#include <skeltrack.h>
+
+#include "joint-stream-layout.h"
+
+/* Publishes every tracked pose to the shared memory object @name, see
+   joint-stream-layout.h. Poses can be published from any thread. */
+gboolean joint_stream_open    (const gchar *name, GError **error);
+void     joint_stream_publish (guint session,
+                               guint frame_index,
+                               SkeltrackJointList pose);
+void     joint_stream_close   (void);
+
+#endif /* __JOINT_STREAM_H__ */
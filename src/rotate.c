@@ -0,0 +1,223 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rotate.h"
+
+/* Side of the destination tiles, small enough for the source lines a
+   tile touches to stay in L1 while it is written */
+#define TILE_SIZE 64
+
+#ifdef __SSE2__
+
+static inline __m128i
+reverse_epi16 (__m128i v)
+{
+  v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+  v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+  return _mm_shuffle_epi32 (v, _MM_SHUFFLE (1, 0, 3, 2));
+}
+
+static inline void
+transpose_8x8_epi16 (__m128i r[8])
+{
+  __m128i a0, a1, a2, a3, a4, a5, a6, a7;
+  __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+  a0 = _mm_unpacklo_epi16 (r[0], r[1]);
+  a1 = _mm_unpackhi_epi16 (r[0], r[1]);
+  a2 = _mm_unpacklo_epi16 (r[2], r[3]);
+  a3 = _mm_unpackhi_epi16 (r[2], r[3]);
+  a4 = _mm_unpacklo_epi16 (r[4], r[5]);
+  a5 = _mm_unpackhi_epi16 (r[4], r[5]);
+  a6 = _mm_unpacklo_epi16 (r[6], r[7]);
+  a7 = _mm_unpackhi_epi16 (r[6], r[7]);
+
+  b0 = _mm_unpacklo_epi32 (a0, a2);
+  b1 = _mm_unpackhi_epi32 (a0, a2);
+  b2 = _mm_unpacklo_epi32 (a1, a3);
+  b3 = _mm_unpackhi_epi32 (a1, a3);
+  b4 = _mm_unpacklo_epi32 (a4, a6);
+  b5 = _mm_unpackhi_epi32 (a4, a6);
+  b6 = _mm_unpacklo_epi32 (a5, a7);
+  b7 = _mm_unpackhi_epi32 (a5, a7);
+
+  r[0] = _mm_unpacklo_epi64 (b0, b4);
+  r[1] = _mm_unpackhi_epi64 (b0, b4);
+  r[2] = _mm_unpacklo_epi64 (b1, b5);
+  r[3] = _mm_unpackhi_epi64 (b1, b5);
+  r[4] = _mm_unpacklo_epi64 (b2, b6);
+  r[5] = _mm_unpackhi_epi64 (b2, b6);
+  r[6] = _mm_unpacklo_epi64 (b3, b7);
+  r[7] = _mm_unpackhi_epi64 (b3, b7);
+}
+
+/* Writes the 8x8 destination block at (x, y) when moving down a
+   destination column walks a source row, forwards if step_y is 1 and
+   backwards if it is -1 */
+static inline void
+transpose_block (const guint16 *src,
+                 guint16 *dst,
+                 gint dst_width,
+                 gint base,
+                 gint step_x,
+                 gint step_y,
+                 gint x,
+                 gint y)
+{
+  __m128i rows[8];
+  gint k;
+
+  for (k = 0; k < 8; k++)
+    {
+      const guint16 *p = src + base + (x + k) * step_x + y * step_y;
+
+      if (step_y == 1)
+        rows[k] = _mm_loadu_si128 ((const __m128i *) p);
+      else
+        rows[k] = reverse_epi16 (_mm_loadu_si128 ((const __m128i *) (p - 7)));
+    }
+
+  transpose_8x8_epi16 (rows);
+
+  for (k = 0; k < 8; k++)
+    _mm_storeu_si128 ((__m128i *) (dst + (y + k) * dst_width + x), rows[k]);
+}
+
+#endif
+
+/* Rotates the @width x @height buffer @src clockwise by @rotation and
+   then mirrors it horizontally if @mirror is set, writing the result to
+   @dst, which must not overlap @src. After a 90 or 270 degree rotation
+   @dst is @height pixels wide.
+
+   Every destination pixel (x, y) comes from src[base + x * step_x +
+   y * step_y]. The destination is walked in tiles so that the strided
+   source reads of a transpose stay in cache, and 8x8 blocks of it are
+   transposed in registers when SSE2 is available. */
+void
+rotate_depth (const guint16 *src,
+              guint16 *dst,
+              gint width,
+              gint height,
+              Rotation rotation,
+              gboolean mirror)
+{
+  gint dst_width, dst_height;
+  gint base, step_x, step_y;
+  gint tile_x, tile_y, x, y;
+
+  switch (rotation)
+    {
+    case ROTATION_90:
+      dst_width = height;
+      dst_height = width;
+      base = (height - 1) * width;
+      step_x = -width;
+      step_y = 1;
+      break;
+    case ROTATION_180:
+      dst_width = width;
+      dst_height = height;
+      base = height * width - 1;
+      step_x = -1;
+      step_y = -width;
+      break;
+    case ROTATION_270:
+      dst_width = height;
+      dst_height = width;
+      base = width - 1;
+      step_x = width;
+      step_y = -1;
+      break;
+    default:
+      dst_width = width;
+      dst_height = height;
+      base = 0;
+      step_x = 1;
+      step_y = width;
+      break;
+    }
+
+  if (mirror)
+    {
+      base += (dst_width - 1) * step_x;
+      step_x = -step_x;
+    }
+
+  if (step_x == 1)
+    {
+      for (y = 0; y < dst_height; y++)
+        memcpy (dst + y * dst_width, src + base + y * step_y,
+                dst_width * sizeof (guint16));
+      return;
+    }
+
+  /* Rows reversed in place, no transpose needed */
+  if (step_x == -1)
+    {
+      for (y = 0; y < dst_height; y++)
+        {
+          guint16 *row = dst + y * dst_width;
+          const guint16 *start = src + base + y * step_y;
+
+          x = 0;
+#ifdef __SSE2__
+          for (; x + 8 <= dst_width; x += 8)
+            _mm_storeu_si128 ((__m128i *) (row + x),
+                              reverse_epi16 (_mm_loadu_si128 (
+                                  (const __m128i *) (start - x - 7))));
+#endif
+          for (; x < dst_width; x++)
+            row[x] = start[-x];
+        }
+      return;
+    }
+
+  for (tile_y = 0; tile_y < dst_height; tile_y += TILE_SIZE)
+    {
+      gint tile_height = MIN (TILE_SIZE, dst_height - tile_y);
+
+      for (tile_x = 0; tile_x < dst_width; tile_x += TILE_SIZE)
+        {
+          gint tile_width = MIN (TILE_SIZE, dst_width - tile_x);
+
+          y = tile_y;
+#ifdef __SSE2__
+          if (step_y == 1 || step_y == -1)
+            {
+              for (; y + 8 <= tile_y + tile_height; y += 8)
+                {
+                  for (x = tile_x; x + 8 <= tile_x + tile_width; x += 8)
+                    transpose_block (src, dst, dst_width,
+                                     base, step_x, step_y, x, y);
+
+                  /* Columns left over at the right of the tile */
+                  for (; x < tile_x + tile_width; x++)
+                    {
+                      gint k;
+
+                      for (k = 0; k < 8; k++)
+                        dst[(y + k) * dst_width + x] =
+                          src[base + x * step_x + (y + k) * step_y];
+                    }
+                }
+            }
+#endif
+          for (; y < tile_y + tile_height; y++)
+            {
+              guint16 *row = dst + y * dst_width;
+              const guint16 *start = src + base + y * step_y;
+
+              for (x = tile_x; x < tile_x + tile_width; x++)
+                row[x] = start[x * step_x];
+            }
+        }
+    }
+}
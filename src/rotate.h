@@ -0,0 +1,22 @@
+#ifndef __ROTATE_H__
+#define __ROTATE_H__
+
+#include <glib.h>
+
+/* Clockwise rotations applied to depth frames */
+typedef enum
+{
+  ROTATION_0,
+  ROTATION_90,
+  ROTATION_180,
+  ROTATION_270
+} Rotation;
+
+void rotate_depth (const guint16 *src,
+                   guint16       *dst,
+                   gint           width,
+                   gint           height,
+                   Rotation       rotation,
+                   gboolean       mirror);
+
+#endif /* __ROTATE_H__ */
@@ -0,0 +1,171 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "trace.h"
+
+/* Number of events kept per thread, older ones are overwritten */
+#define TRACE_BUFFER_EVENTS 65536
+
+typedef struct
+{
+  const gchar *name;
+  gint64 start;
+  gint64 end;
+} TraceEvent;
+
+/* Written only by the thread using it; head counts every event ever
+   recorded and is published after the event it covers. When its thread
+   exits the buffer is kept, with its events, for the next new thread,
+   so the pool starting new workers neither grows the memory used nor
+   the number of rows in the trace. */
+typedef struct
+{
+  guint thread_id;
+  gboolean in_use;
+  gint head;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+gboolean trace_enabled = FALSE;
+
+static void trace_buffer_retire (gpointer data);
+
+static GPrivate trace_buffer_key = G_PRIVATE_INIT (trace_buffer_retire);
+static GMutex trace_buffers_lock;
+static GList *trace_buffers = NULL;
+static gint64 trace_start = 0;
+
+static void
+trace_buffer_retire (gpointer data)
+{
+  TraceBuffer *buffer = (TraceBuffer *) data;
+
+  g_mutex_lock (&trace_buffers_lock);
+  buffer->in_use = FALSE;
+  g_mutex_unlock (&trace_buffers_lock);
+}
+
+static TraceBuffer *
+trace_buffer_get (void)
+{
+  TraceBuffer *buffer;
+  GList *node;
+
+  buffer = g_private_get (&trace_buffer_key);
+  if (G_LIKELY (buffer != NULL))
+    return buffer;
+
+  g_mutex_lock (&trace_buffers_lock);
+  for (node = trace_buffers; node != NULL; node = g_list_next (node))
+    {
+      buffer = (TraceBuffer *) node->data;
+      if (! buffer->in_use)
+        break;
+    }
+
+  if (node == NULL)
+    {
+      buffer = g_new0 (TraceBuffer, 1);
+      buffer->thread_id = g_list_length (trace_buffers) + 1;
+      trace_buffers = g_list_append (trace_buffers, buffer);
+    }
+  buffer->in_use = TRUE;
+  g_mutex_unlock (&trace_buffers_lock);
+
+  g_private_set (&trace_buffer_key, buffer);
+
+  return buffer;
+}
+
+/* Must be called from the main thread, which gets the first buffer */
+void
+trace_init (void)
+{
+  trace_start = g_get_monotonic_time ();
+  trace_buffer_get ();
+  trace_enabled = TRUE;
+}
+
+void
+trace_record (const gchar *name, gint64 start, gint64 end)
+{
+  TraceBuffer *buffer = trace_buffer_get ();
+  gint head = buffer->head;
+  TraceEvent *event = &buffer->events[head % TRACE_BUFFER_EVENTS];
+
+  event->name = name;
+  event->start = start;
+  event->end = end;
+
+  g_atomic_int_set (&buffer->head, head + 1);
+}
+
+static void
+trace_append_buffer (GString *json, TraceBuffer *buffer, gboolean *first)
+{
+  TraceEvent *events;
+  gint head, oldest, i;
+
+  /* Copy what is there and then drop whatever the thread may have
+     overwritten while we were copying */
+  head = g_atomic_int_get (&buffer->head);
+  events = g_malloc (sizeof (buffer->events));
+  memcpy (events, buffer->events, sizeof (buffer->events));
+  oldest = g_atomic_int_get (&buffer->head) - TRACE_BUFFER_EVENTS + 1;
+  oldest = MAX (oldest, 0);
+
+  g_string_append_printf (json,
+                          "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                          "\"pid\":1,\"tid\":%u,"
+                          "\"args\":{\"name\":\"%s %u\"}}",
+                          *first ? "" : ",",
+                          buffer->thread_id,
+                          buffer->thread_id == 1 ? "main" : "worker",
+                          buffer->thread_id);
+  *first = FALSE;
+
+  for (i = oldest; i < head; i++)
+    {
+      TraceEvent *event = &events[i % TRACE_BUFFER_EVENTS];
+
+      g_string_append_printf (json,
+                              ",\n{\"name\":\"%s\",\"cat\":\"pipeline\","
+                              "\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%" G_GINT64_FORMAT ","
+                              "\"dur\":%" G_GINT64_FORMAT "}",
+                              event->name,
+                              buffer->thread_id,
+                              event->start - trace_start,
+                              event->end - event->start);
+    }
+
+  g_free (events);
+}
+
+/* Writes the recorded events in the Chrome trace event format, which
+   chrome://tracing and Perfetto can open */
+gboolean
+trace_write (const gchar *path, GError **error)
+{
+  GString *json;
+  GList *node;
+  gboolean first = TRUE;
+  gboolean written;
+
+  json = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  g_mutex_lock (&trace_buffers_lock);
+  for (node = trace_buffers; node != NULL; node = g_list_next (node))
+    trace_append_buffer (json, (TraceBuffer *) node->data, &first);
+  g_mutex_unlock (&trace_buffers_lock);
+
+  g_string_append (json, "\n]}\n");
+
+  written = g_file_set_contents (path, json->str, json->len, error);
+  g_string_free (json, TRUE);
+
+  return written;
+}
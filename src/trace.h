@@ -0,0 +1,28 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+#ifdef ENABLE_TRACING
+
+/* Events are only recorded once trace_init () has been called, so the
+   cost of a disabled trace point is a single test */
+extern gboolean trace_enabled;
+
+void     trace_init   (void);
+void     trace_record (const gchar *name, gint64 start, gint64 end);
+gboolean trace_write  (const gchar *path, GError **error);
+
+#define TRACE_COMPLETE(name, start, end)                \
+  G_STMT_START {                                        \
+    if (G_UNLIKELY (trace_enabled))                     \
+      trace_record ((name), (start), (end));            \
+  } G_STMT_END
+
+#else
+
+#define TRACE_COMPLETE(name, start, end) G_STMT_START { } G_STMT_END
+
+#endif
+
+#endif /* __TRACE_H__ */
@@ -1,3 +1,7 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <skeltrack.h>
 #include <math.h>
 #include <string.h>
@@ -5,6 +9,14 @@
 #include <glib-object.h>
 #include <clutter/clutter.h>
 #include <clutter/clutter-keysyms.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "rotate.h"
+#include "trace.h"
+#include "joint-stream.h"
 
 static SkeltrackSkeleton *skeleton = NULL;
 static ClutterActor *info_text;
@@ -12,14 +24,6 @@ static ClutterActor *skeleton_tex;
 static ClutterActor *depth_tex;
 static ClutterActor *instructions;
 
-static GList *skeleton_list = NULL;
-static GList *frame_path_list = NULL;
-static GList *frame_list = NULL;
-
-static GList *current_frame_path = NULL;
-static GList *current_frame = NULL;
-static GList *current_skeleton = NULL;
-
 static gboolean SHOW_SKELETON = TRUE;
 static gboolean ENABLE_SMOOTHING = FALSE;
 static gfloat SMOOTHING_FACTOR = .0;
@@ -31,11 +35,26 @@ static guint THRESHOLD_END   = 8000;
 
 #define POINT_SIZE 6
 
-static gint width = 640;
-static gint height = 480;
-static gint dimension_reduction = 16;
+/* Default for --max-memory, shared by all the open recordings */
+#define DEFAULT_MAX_MEMORY (256 * 1024 * 1024)
 
-static guint current_frame_number = 0;
+/* Side of the square blocks whose mean depth and hash make up a frame
+   fingerprint, and how much a block mean may change between two frames
+   that are still considered the same scene. The display repaints whole
+   blocks too. */
+#define FINGERPRINT_BLOCK     16
+#define FINGERPRINT_TOLERANCE 20
+
+/* What a tracked pose costs, as allocated by skeltrack */
+#define POSE_SIZE (SKELTRACK_JOINT_MAX_JOINTS * \
+                   (sizeof (SkeltrackJoint) + sizeof (SkeltrackJoint *)))
+
+/* Key file in a recording directory that is not a frame; its
+   [recording] group may set the rotation (in degrees) and mirror */
+#define RECORDING_METADATA "metadata.ini"
+
+#define SESSION_PRIORITY_BACKGROUND 0
+#define SESSION_PRIORITY_ACTIVE     1
 
 typedef struct
 {
@@ -46,23 +65,282 @@ typedef struct
   gint reduced_height;
 } BufferInfo;
 
+/* The depth buffer is pinned while users is not zero. It is protected
+   by the session lock and may be evicted.
+
+   Once the frame has been read, hash, blocks and block_hashes
+   fingerprint its content. A frame whose depth compares equal to the
+   previous one shares the depth buffer of source, and one that is only a near duplicate of the last
+   tracked key frame is marked as such so that tracking reuses its pose.
+   source and duplicate are protected by the session lock too. */
+typedef struct _Frame Frame;
+struct _Frame
+{
+  gchar *path;
+  guint16 *depth;
+  guint index;
+  gint users;
+
+  gboolean fingerprinted;
+  guint64 hash;
+  guint16 *blocks;
+  guint32 *block_hashes;
+  guint n_blocks;
+  Frame *source;
+  gboolean duplicate;
+};
+
+/* One opened recording. The frame and skeleton lists have the same
+   length; the data of a skeleton_list node is NULL until that frame
+   has been tracked. Frame depth buffers may be NULL when they are not
+   resident, in which case they are read again when needed.
+
+   Frames are raw_width x raw_height on disk and are rotated when read,
+   width and height being the rotated size. generation changes with the
+   rotation so that buffers read for an older one are not kept.
+
+   Skeltrack smooths a pose with the ones tracked before it, so with
+   smoothing enabled the key frames are tracked one after the other on
+   tracker instead of in parallel. */
+typedef struct
+{
+  gchar *directory;
+  guint id;
+  gint priority;
+
+  GMutex lock;
+
+  GList *frame_path_list;
+  GList *frame_list;
+  GList *skeleton_list;
+
+  GList *current_frame;
+  GList *current_skeleton;
+  guint current_frame_number;
+
+  gint raw_width;
+  gint raw_height;
+  Rotation rotation;
+  gboolean mirror;
+  guint generation;
+
+  gint width;
+  gint height;
+  gsize frame_size;
+  gint dimension_reduction;
+  guint threshold_end;
+
+  gboolean tracking;
+  SkeltrackSkeleton *tracker;
+  gint pending_fingerprints;
+  gint pending_tracks;
+  gint64 track_start;
+  guint skipped_frames;
+} Session;
+
+typedef enum
+{
+  JOB_LOAD,
+  JOB_FINGERPRINT,
+  JOB_TRACK
+} JobType;
+
+typedef struct
+{
+  JobType type;
+  Session *session;
+  Frame *frame;
+  GList *frame_node;
+  GList *skeleton_node;
+  gint width;
+  gint height;
+  gint dimension_reduction;
+  guint threshold_begin;
+  guint threshold_end;
+} Job;
+
+/* Threads loading and tracking frames for every session */
+typedef struct
+{
+  GThreadPool *pool;
+  /* Set when quitting: queued jobs are then only freed, and smoothed
+     tracks stop queuing their next key frame. lock keeps those from
+     pushing to a pool that is being freed. */
+  GMutex lock;
+  gboolean shutting_down;
+} WorkerPool;
+
+static WorkerPool worker_pool;
+
+typedef enum
+{
+  MEMORY_FRAMES,
+  MEMORY_SCRATCH,
+  MEMORY_LENT,
+  MEMORY_RENDERS,
+  MEMORY_POSES,
+  MEMORY_LAST
+} MemoryKind;
+
+/* Accounts everything the player keeps against --max-memory. When it
+   runs short, the frames furthest from the cursor are dropped, lower
+   priority sessions before the active one. The
+   current frame of a session, or the frame whose depth buffer it
+   shares, is never evicted, and poses never are. Depth buffers that
+   cannot be kept are lent to whoever needs them, and are counted until
+   they are given back. */
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  gsize limit;
+  gsize total;
+  gsize usage[MEMORY_LAST];
+  guint evictions;
+} MemoryGovernor;
+
+static MemoryGovernor memory;
+static gsize max_memory = DEFAULT_MAX_MEMORY;
+
+/* Stages of the frame pipeline whose timing is collected */
+typedef enum
+{
+  STAGE_READ,
+  STAGE_ROTATE,
+  STAGE_REDUCE,
+  STAGE_TRACK,
+  STAGE_GRAYSCALE,
+  STAGE_PAINT,
+  STAGE_UPLOAD,
+  STAGE_FRAME,
+  STAGE_LAST
+} Stage;
+
+static const gchar *stage_names[STAGE_LAST] = {
+  "read",
+  "rotate",
+  "reduce",
+  "track",
+  "grayscale",
+  "paint",
+  "upload",
+  "frame"
+};
+
+typedef struct
+{
+  gint64 count;
+  gint64 total;
+  gint64 max;
+} StageCounter;
+
+static StageCounter stage_counters[STAGE_LAST];
+static GMutex stage_counters_lock;
+
+/* Clients connected to the control socket. Replies the socket does not
+   take at once wait in output; a client that stops reading, or whose
+   socket failed, is broken and dropped. */
+typedef struct
+{
+  GIOChannel *channel;
+  guint watch;
+  guint output_watch;
+  GString *output;
+  gboolean broken;
+  Session *waiting_for;
+} ControlClient;
+
+/* How many unread reply bytes a control client may pile up */
+#define CONTROL_MAX_OUTPUT (1024 * 1024)
+
+static gchar *control_socket_path = NULL;
+static gchar *trace_path = NULL;
+static gchar *joint_stream_name = NULL;
+static gint rotation_degrees = 0;
+static gboolean mirror = FALSE;
+static GList *control_clients = NULL;
+static guint play_source = 0;
+
+static GList *session_list = NULL;
+static Session *active_session = NULL;
+
+/* What the depth and skeleton textures show. render is the grayscale
+   image on screen, cut at threshold, and buffer the same with the joint
+   points drawn on it, as uploaded to depth_tex unless uploaded is FALSE;
+   points are the areas of those joints. hashes are the block hashes of
+   the frame on screen, if known, and dirty_blocks the blocks that differ
+   from the next frame. skeleton_area bounds what was last drawn on
+   skeleton_tex. */
+typedef struct
+{
+  gint width;
+  gint height;
+  guint threshold;
+  guchar *render;
+  guchar *buffer;
+  GArray *points;
+  gboolean valid;
+  gboolean uploaded;
+
+  guint32 *hashes;
+  guint8 *dirty_blocks;
+  guint n_blocks;
+  gboolean hashes_valid;
+
+  cairo_rectangle_int_t skeleton_area;
+  gboolean skeleton_valid;
+} Display;
+
+static Display display;
+
 static void
 set_orientation ()
 {
   ClutterActor *stage;
+  gint width, height;
 
   stage = clutter_stage_get_default ();
+  width = active_session->width;
+  height = active_session->height;
 
   clutter_actor_set_size (skeleton_tex, width, height);
   clutter_actor_set_size (depth_tex, width, height);
   clutter_cairo_texture_set_surface_size (CLUTTER_CAIRO_TEXTURE (skeleton_tex), width, height);
   clutter_cairo_texture_set_surface_size (CLUTTER_CAIRO_TEXTURE (depth_tex), width, height);
-  clutter_actor_set_size (stage, width * 2, height + 250);
+  clutter_actor_set_size (stage, width * 2, height + 290);
   clutter_actor_set_position (depth_tex, width, 0.0);
   clutter_actor_set_position (info_text, 50, height + 20);
-  clutter_actor_set_position (instructions, 50, height + 70);
+  clutter_actor_set_position (instructions, 50, height + 110);
+
+  display.valid = FALSE;
+  display.skeleton_valid = FALSE;
+}
+
+
+/* Adds the time elapsed since @start, taken with
+   g_get_monotonic_time (), to the counter of @stage and to the trace */
+static void
+stage_record (Stage stage, gint64 start)
+{
+  gint64 end = g_get_monotonic_time ();
+  gint64 elapsed = end - start;
+
+  TRACE_COMPLETE (stage_names[stage], start, end);
+
+  g_mutex_lock (&stage_counters_lock);
+  stage_counters[stage].count++;
+  stage_counters[stage].total += elapsed;
+  stage_counters[stage].max = MAX (stage_counters[stage].max, elapsed);
+  g_mutex_unlock (&stage_counters_lock);
 }
 
+static void
+stage_counters_reset (void)
+{
+  g_mutex_lock (&stage_counters_lock);
+  memset (stage_counters, 0, sizeof (stage_counters));
+  g_mutex_unlock (&stage_counters_lock);
+}
 
 static void
 grayscale_buffer_set_value (guchar *buffer, gint index, guchar value)
@@ -150,34 +428,6 @@ process_buffer (guint16 *buffer,
   return buffer_info;
 }
 
-static guchar *
-create_grayscale_buffer (guint16 *buffer, gint width, gint height)
-{
-  gint i,j;
-  gint size;
-  guchar *grayscale_buffer;
-
-  size = width * height * sizeof (guchar) * 3;
-  grayscale_buffer = g_slice_alloc (size);
-  /*Paint is white*/
-  memset (grayscale_buffer, 255, size);
-
-  for (i = 0; i < width; i++)
-    {
-      for (j = 0; j < height; j++)
-        {
-          guint16 value = round (buffer[j * width + i] * 256. / 3000.);
-          if (value != 0)
-            {
-              gint index = j * width + i;
-              grayscale_buffer_set_value (grayscale_buffer, index, value);
-            }
-        }
-    }
-
-  return grayscale_buffer;
-}
-
 static GList *
 get_frame_path_list (const gchar *directory)
 {
@@ -197,10 +447,15 @@ get_frame_path_list (const gchar *directory)
   const gchar *current_file;
   while ((current_file = g_dir_read_name(dir)) != NULL)
     {
+      if (g_strcmp0 (current_file, RECORDING_METADATA) == 0)
+        continue;
+
       gchar *current_path = g_strconcat (directory, "/", current_file, NULL);
       list = g_list_insert_sorted (list, current_path, (GCompareFunc) g_strcmp0);
     }
 
+  g_dir_close (dir);
+
   return list;
 }
 
@@ -232,242 +487,1462 @@ read_file_to_buffer (const gchar *name, gsize count, GError *e)
         {
           g_debug ("ERROR: %s", error->message);
         }
+      g_object_unref (input_stream);
     }
+  g_object_unref (new_file);
   return depth;
 }
 
-void read_video (gchar *directory,
-                 gint width,
-                 gint height,
-                 gint dimension_reduction)
+static gboolean
+memory_try_charge (MemoryKind kind, gsize bytes)
 {
-  GError *error = NULL;
-
-  gchar *frame_path;
-  gint i;
-
-  frame_path_list = get_frame_path_list (directory);
+  gboolean fits;
 
-  for (current_frame_path = g_list_first (frame_path_list);
-       current_frame_path != NULL;
-       current_frame_path = g_list_next (current_frame_path))
+  g_mutex_lock (&memory.lock);
+  fits = memory.total + bytes <= memory.limit;
+  if (fits)
     {
-      frame_path = (gchar *) current_frame_path->data;
-
-      guint16 *depth = read_file_to_buffer (frame_path, width * height * sizeof
-          (guint16), error);
-
-      if (error != NULL)
-        {
-          g_debug ("ERROR: %s", error->message);
-          return;
-        }
-
-      frame_list = g_list_append (frame_list, depth);
+      memory.usage[kind] += bytes;
+      memory.total += bytes;
     }
+  g_mutex_unlock (&memory.lock);
 
-  current_frame_path = g_list_first (frame_path_list);
+  return fits;
 }
 
+/* Charges memory that cannot be refused, like tracked poses */
 static void
-paint_joint (cairo_t *cairo,
-             SkeltrackJoint *joint,
-             gint radius,
-             const gchar *color_str)
+memory_charge (MemoryKind kind, gsize bytes)
 {
-  ClutterColor *color;
-
-  if (joint == NULL)
-    return;
-
-  color = clutter_color_new (0, 0, 0, 200);
-  clutter_color_from_string (color, color_str);
-
-  cairo_set_line_width (cairo, 10);
-  clutter_cairo_set_source_color (cairo, color);
-  cairo_arc (cairo,
-             joint->screen_x,
-             joint->screen_y,
-             radius / joint->z,
-             0,
-             G_PI * 2);
-  cairo_fill (cairo);
-  clutter_color_free (color);
+  g_mutex_lock (&memory.lock);
+  memory.usage[kind] += bytes;
+  memory.total += bytes;
+  g_mutex_unlock (&memory.lock);
 }
 
 static void
-connect_joints (cairo_t *cairo,
-                SkeltrackJoint *joint_a,
-                SkeltrackJoint *joint_b,
-                const gchar *color_str)
+memory_uncharge (MemoryKind kind, gsize bytes)
 {
-  ClutterColor *color;
+  g_mutex_lock (&memory.lock);
+  memory.usage[kind] -= bytes;
+  memory.total -= bytes;
+  g_cond_broadcast (&memory.cond);
+  g_mutex_unlock (&memory.lock);
+}
 
-  if (joint_a == NULL || joint_b == NULL)
-    return;
+static gboolean
+memory_is_short (gsize bytes)
+{
+  gboolean short_of_memory;
 
-  color = clutter_color_new (0, 0, 0, 200);
-  clutter_color_from_string (color, color_str);
+  g_mutex_lock (&memory.lock);
+  short_of_memory = memory.total + bytes > memory.limit;
+  g_mutex_unlock (&memory.lock);
 
-  cairo_set_line_width (cairo, 10);
-  clutter_cairo_set_source_color (cairo, color);
-  cairo_move_to (cairo,
-                 joint_a->screen_x,
-                 joint_a->screen_y);
-  cairo_line_to (cairo,
-                 joint_b->screen_x,
-                 joint_b->screen_y);
-  cairo_stroke (cairo);
-  clutter_color_free (color);
+  return short_of_memory;
 }
 
-static void
-on_texture_draw (ClutterCairoTexture *texture,
-                 cairo_t *cairo,
-                 gpointer user_data)
+/* Frees the unpinned depth buffer that is cheapest to lose. Returns
+   FALSE when there is nothing left to evict. */
+static gboolean
+memory_evict (void)
 {
-  guint width, height;
-  ClutterColor *color;
-  SkeltrackJoint *head, *left_hand, *right_hand,
-    *left_shoulder, *right_shoulder, *left_elbow, *right_elbow;
-  SkeltrackJointList list;
+  Session *victim_session = NULL;
+  Frame *victim = NULL;
+  gint victim_priority = 0;
+  guint victim_distance = 0;
+  gsize freed = 0;
+  GList *node, *frame_node;
+
+  for (node = session_list; node != NULL; node = g_list_next (node))
+    {
+      Session *session = (Session *) node->data;
+      guint cursor = session->current_frame_number > 0 ?
+        session->current_frame_number - 1 : 0;
+      gint priority = g_atomic_int_get (&session->priority);
+      Frame *current;
+
+      g_mutex_lock (&session->lock);
+      current = (Frame *) g_list_nth_data (session->frame_list, cursor);
+      for (frame_node = session->frame_list;
+           frame_node != NULL;
+           frame_node = g_list_next (frame_node))
+        {
+          Frame *frame = (Frame *) frame_node->data;
+          guint distance;
 
-  list = (SkeltrackJointList) current_skeleton->data;
-  if (list == NULL)
-    return;
+          if (frame == current ||
+              (current != NULL && frame == current->source))
+            continue;
+          if (frame->depth == NULL || frame->users > 0)
+            continue;
 
-  head = skeltrack_joint_list_get_joint (list,
-                                         SKELTRACK_JOINT_ID_HEAD);
-  left_hand = skeltrack_joint_list_get_joint (list,
-                                              SKELTRACK_JOINT_ID_LEFT_HAND);
-  right_hand = skeltrack_joint_list_get_joint (list,
-                                               SKELTRACK_JOINT_ID_RIGHT_HAND);
-  left_shoulder = skeltrack_joint_list_get_joint (list,
-                                       SKELTRACK_JOINT_ID_LEFT_SHOULDER);
-  right_shoulder = skeltrack_joint_list_get_joint (list,
-                                       SKELTRACK_JOINT_ID_RIGHT_SHOULDER);
-  left_elbow = skeltrack_joint_list_get_joint (list,
-                                               SKELTRACK_JOINT_ID_LEFT_ELBOW);
-  right_elbow = skeltrack_joint_list_get_joint (list,
-                                                SKELTRACK_JOINT_ID_RIGHT_ELBOW);
+          distance = ABS ((gint) frame->index - (gint) cursor);
+          if (victim == NULL ||
+              priority < victim_priority ||
+              (priority == victim_priority &&
+               distance > victim_distance))
+            {
+              victim_session = session;
+              victim = frame;
+              victim_priority = priority;
+              victim_distance = distance;
+            }
+        }
+      g_mutex_unlock (&session->lock);
+    }
 
-  /* Paint it white */
-  clutter_cairo_texture_clear (texture);
-  clutter_cairo_texture_get_surface_size (texture, &width, &height);
-  color = clutter_color_new (255, 255, 255, 255);
-  clutter_cairo_set_source_color (cairo, color);
-  cairo_rectangle (cairo, 0, 0, width, height);
-  cairo_fill (cairo);
-  clutter_color_free (color);
+  if (victim == NULL)
+    return FALSE;
 
-  paint_joint (cairo, head, 50000, "#FFF800");
+  /* Check again, it may have changed while no lock was held */
+  g_mutex_lock (&victim_session->lock);
+  if (victim->depth != NULL && victim->users == 0)
+    {
+      freed = victim_session->frame_size;
+      g_slice_free1 (freed, victim->depth);
+      victim->depth = NULL;
+    }
+  g_mutex_unlock (&victim_session->lock);
 
-  connect_joints (cairo, left_shoulder, right_shoulder, "#afafaf");
+  if (freed > 0)
+    {
+      memory_uncharge (MEMORY_FRAMES, freed);
 
-  connect_joints (cairo, left_shoulder, left_elbow, "#afafaf");
+      g_mutex_lock (&memory.lock);
+      memory.evictions++;
+      g_mutex_unlock (&memory.lock);
+    }
 
-  connect_joints (cairo, right_shoulder, right_elbow, "#afafaf");
+  return TRUE;
+}
 
-  connect_joints (cairo, right_hand, right_elbow, "#afafaf");
+static void
+memory_make_room (gsize bytes)
+{
+  while (memory_is_short (bytes) && memory_evict ())
+    ;
+}
 
-  connect_joints (cairo, left_hand, left_elbow, "#afafaf");
+static gboolean
+memory_charge_evicting (MemoryKind kind, gsize bytes)
+{
+  if (memory_try_charge (kind, bytes))
+    return TRUE;
 
-  paint_joint (cairo, left_hand, 30000, "#C2FF00");
+  memory_make_room (bytes);
 
-  paint_joint (cairo, right_hand, 30000, "#00FAFF");
+  return memory_try_charge (kind, bytes);
 }
 
+/* Blocks until @bytes of @kind, scratch buffers or lent depth buffers,
+   fit under the limit. One is always let through when no other memory
+   of that kind is in use so that a limit smaller than a single buffer
+   cannot stall the pool. Lent buffers are never held while waiting for
+   memory, so waiting for one while holding scratch cannot deadlock. */
 static void
-set_info_text (void)
+memory_reserve (MemoryKind kind, gsize bytes)
 {
-  gchar *title;
-  gchar *frame_file_name;
-
-  frame_file_name = (gchar *) g_list_nth_data (frame_path_list,
-                                               current_frame_number-1);
-
-  title = g_strdup_printf( "<b>Threshold:</b> %d\t\t\t\t"
-                           "<b>Frame:</b> %d - %s\n"
-                           "<b>Smoothing Enabled:</b> %s\t\t\t"
-                           "<b>Smoothing Level:</b> %.2f\t\t\t",
-                           THRESHOLD_END,
-                           current_frame_number,
-                           frame_file_name? frame_file_name : "",
-                           ENABLE_SMOOTHING ? "Yes" : "No",
-                           SMOOTHING_FACTOR
-                           );
-  clutter_text_set_markup (CLUTTER_TEXT (info_text), title);
-  g_free (title);
+  memory_make_room (bytes);
+
+  g_mutex_lock (&memory.lock);
+  while (memory.usage[kind] > 0 &&
+         memory.total + bytes > memory.limit)
+    g_cond_wait (&memory.cond, &memory.lock);
+  memory.usage[kind] += bytes;
+  memory.total += bytes;
+  g_mutex_unlock (&memory.lock);
 }
 
 static void
-set_threshold (gint difference)
+init_memory_governor (void)
 {
-  gint new_threshold = THRESHOLD_END + difference;
-  if (new_threshold >= THRESHOLD_BEGIN + 300 &&
-      new_threshold <= 8000)
-    THRESHOLD_END = new_threshold;
+  g_mutex_init (&memory.lock);
+  g_cond_init (&memory.cond);
+  memory.limit = max_memory;
 }
 
 static void
-enable_smoothing (gboolean enable)
+worker_pool_push (Session *session,
+                  JobType type,
+                  GList *frame_node,
+                  GList *skeleton_node)
 {
-  if (skeleton != NULL)
-    g_object_set (skeleton, "enable-smoothing", enable, NULL);
+  Job *job;
+
+  job = g_slice_new0 (Job);
+  job->type = type;
+  job->session = session;
+  job->frame = (Frame *) frame_node->data;
+  job->frame_node = frame_node;
+  job->skeleton_node = skeleton_node;
+  job->width = session->width;
+  job->height = session->height;
+  job->dimension_reduction = session->dimension_reduction;
+  job->threshold_begin = THRESHOLD_BEGIN;
+  job->threshold_end = session->threshold_end;
+
+  g_thread_pool_push (worker_pool.pool, job, NULL);
 }
 
 static void
-set_smoothing_factor (gfloat factor)
+frame_free_fingerprint (Frame *frame)
 {
-  if (skeleton != NULL)
+  if (frame->blocks != NULL)
     {
-      SMOOTHING_FACTOR += factor;
-      SMOOTHING_FACTOR = CLAMP (SMOOTHING_FACTOR, 0.0, 1.0);
-      g_object_set (skeleton, "smoothing-factor", SMOOTHING_FACTOR, NULL);
+      g_slice_free1 (frame->n_blocks * sizeof (guint16), frame->blocks);
+      g_slice_free1 (frame->n_blocks * sizeof (guint32), frame->block_hashes);
     }
+  frame->blocks = NULL;
+  frame->block_hashes = NULL;
+  frame->fingerprinted = FALSE;
 }
 
-static gboolean
-paint_depth (guchar *buffer, guint width, guint height)
+/* Computes the fingerprint of @frame from its @depth buffer: a 64 bit
+   FNV-1a hash of the whole buffer, taken a word at a time, and the mean
+   depth and 32 bit FNV-1a hash of every FINGERPRINT_BLOCK square */
+static void
+frame_fingerprint (Session *session,
+                   Frame *frame,
+                   guint16 *depth,
+                   guint generation)
 {
-  gchar *head_color, *left_shoulder_color, *right_shoulder_color,
-        *left_elbow_color, *right_elbow_color, *left_hand_color,
-        *right_hand_color;
+  guint64 hash = 14695981039346656037ULL;
+  const guint64 *words = (const guint64 *) depth;
+  gsize n_words = session->frame_size / sizeof (guint64);
+  gint width, height, blocks_width, blocks_height;
+  guint32 *sums, *block_hashes;
+  guint16 *blocks;
+  guint n_blocks;
+  gint i, j;
 
-  head_color = "#ff0000";
-  left_hand_color = "#00ff00";
-  right_hand_color = "#0000ff";
-  left_elbow_color = "#97FF93";
-  right_elbow_color = "#9094FF";
-  left_shoulder_color = "#125500";
-  right_shoulder_color = "#000045";
+  g_mutex_lock (&session->lock);
+  if (frame->fingerprinted || generation != session->generation)
+    {
+      g_mutex_unlock (&session->lock);
+      return;
+    }
+  width = session->width;
+  height = session->height;
+  g_mutex_unlock (&session->lock);
 
-  SkeltrackJoint *head, *left_hand, *right_hand,
-    *left_shoulder, *right_shoulder, *left_elbow, *right_elbow;
-  SkeltrackJointList list;
+  for (i = 0; i < n_words; i++)
+    {
+      hash ^= words[i];
+      hash *= 1099511628211ULL;
+    }
 
-  list = (SkeltrackJointList) current_skeleton->data;
-  if (list == NULL)
-    return;
+  blocks_width = width / FINGERPRINT_BLOCK;
+  blocks_height = height / FINGERPRINT_BLOCK;
+  n_blocks = blocks_width * blocks_height;
+  sums = g_new0 (guint32, n_blocks);
+  block_hashes = g_slice_alloc (n_blocks * sizeof (guint32));
+  for (i = 0; i < n_blocks; i++)
+    block_hashes[i] = 2166136261U;
 
-  head = skeltrack_joint_list_get_joint (list,
-                                         SKELTRACK_JOINT_ID_HEAD);
-  left_hand = skeltrack_joint_list_get_joint (list,
-                                              SKELTRACK_JOINT_ID_LEFT_HAND);
-  right_hand = skeltrack_joint_list_get_joint (list,
-                                               SKELTRACK_JOINT_ID_RIGHT_HAND);
-  left_shoulder = skeltrack_joint_list_get_joint (list,
-                                       SKELTRACK_JOINT_ID_LEFT_SHOULDER);
-  right_shoulder = skeltrack_joint_list_get_joint (list,
-                                       SKELTRACK_JOINT_ID_RIGHT_SHOULDER);
-  left_elbow = skeltrack_joint_list_get_joint (list,
-                                               SKELTRACK_JOINT_ID_LEFT_ELBOW);
-  right_elbow = skeltrack_joint_list_get_joint (list,
-                                                SKELTRACK_JOINT_ID_RIGHT_ELBOW);
+  for (j = 0; j < blocks_height * FINGERPRINT_BLOCK; j++)
+    {
+      guint32 *row_sums = sums + (j / FINGERPRINT_BLOCK) * blocks_width;
+      guint32 *row_hashes = block_hashes +
+        (j / FINGERPRINT_BLOCK) * blocks_width;
+      guint16 *row = depth + j * width;
 
+      for (i = 0; i < blocks_width * FINGERPRINT_BLOCK; i++)
+        {
+          row_sums[i / FINGERPRINT_BLOCK] += row[i];
+          row_hashes[i / FINGERPRINT_BLOCK] =
+            (row_hashes[i / FINGERPRINT_BLOCK] ^ row[i]) * 16777619U;
+        }
+    }
 
-  if (head)
-    draw_point (buffer, width, height, head_color, head->screen_x,
+  blocks = g_slice_alloc (n_blocks * sizeof (guint16));
+  for (i = 0; i < n_blocks; i++)
+    blocks[i] = sums[i] / (FINGERPRINT_BLOCK * FINGERPRINT_BLOCK);
+  g_free (sums);
+
+  g_mutex_lock (&session->lock);
+  if (! frame->fingerprinted && generation == session->generation)
+    {
+      frame->hash = hash;
+      frame->blocks = blocks;
+      frame->block_hashes = block_hashes;
+      frame->n_blocks = n_blocks;
+      frame->fingerprinted = TRUE;
+      blocks = NULL;
+    }
+  g_mutex_unlock (&session->lock);
+
+  if (blocks != NULL)
+    {
+      g_slice_free1 (n_blocks * sizeof (guint16), blocks);
+      g_slice_free1 (n_blocks * sizeof (guint32), block_hashes);
+    }
+}
+
+/* Whether @frame shows the same scene as @previous, within the sensor
+   noise tolerance. Loads publish fingerprints at any time, so this is
+   called with the session lock held. */
+static gboolean
+frame_is_near_duplicate (Frame *previous, Frame *frame)
+{
+  gint i;
+
+  if (! previous->fingerprinted || ! frame->fingerprinted ||
+      previous->n_blocks != frame->n_blocks)
+    return FALSE;
+
+  for (i = 0; i < frame->n_blocks; i++)
+    {
+      if (ABS ((gint) previous->blocks[i] - (gint) frame->blocks[i]) >
+          FINGERPRINT_TOLERANCE)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reads @frame from disk and applies the session rotation to it, setting
+   @generation to the rotation generation the buffer is valid for */
+static guint16 *
+session_read_depth (Session *session, Frame *frame, guint *generation)
+{
+  Rotation rotation;
+  gboolean mirror;
+  guint16 *depth, *rotated;
+  gint64 start;
+
+  g_mutex_lock (&session->lock);
+  rotation = session->rotation;
+  mirror = session->mirror;
+  *generation = session->generation;
+  g_mutex_unlock (&session->lock);
+
+  start = g_get_monotonic_time ();
+  depth = read_file_to_buffer (frame->path, session->frame_size, NULL);
+  if (depth == NULL)
+    return NULL;
+  stage_record (STAGE_READ, start);
+
+  if (rotation == ROTATION_0 && ! mirror)
+    return depth;
+
+  start = g_get_monotonic_time ();
+  rotated = g_slice_alloc (session->frame_size);
+  rotate_depth (depth, rotated, session->raw_width, session->raw_height,
+                rotation, mirror);
+  g_slice_free1 (session->frame_size, depth);
+  stage_record (STAGE_ROTATE, start);
+
+  return rotated;
+}
+
+/* Returns the depth buffer of @frame, reading it from disk if it is not
+   resident, and pins it until session_release_depth () is called. When
+   it cannot be kept under the memory limit it is only lent to the
+   caller, and charged as such until it is released. Unless @wait is
+   set, a lent buffer is charged at once instead of waiting for others
+   to be released, so that the main thread never blocks here. */
+static guint16 *
+session_get_depth (Session *session, Frame *frame, gboolean wait)
+{
+  guint16 *depth;
+  gboolean resident;
+  guint generation;
+
+  g_mutex_lock (&session->lock);
+  if (frame->source != NULL)
+    frame = frame->source;
+  depth = frame->depth;
+  if (depth != NULL)
+    frame->users++;
+  g_mutex_unlock (&session->lock);
+
+  if (depth != NULL)
+    return depth;
+
+  resident = memory_charge_evicting (MEMORY_FRAMES, session->frame_size);
+  if (! resident && wait)
+    memory_reserve (MEMORY_LENT, session->frame_size);
+  else if (! resident)
+    memory_charge (MEMORY_LENT, session->frame_size);
+
+  depth = session_read_depth (session, frame, &generation);
+  if (depth == NULL)
+    {
+      memory_uncharge (resident ? MEMORY_FRAMES : MEMORY_LENT,
+                       session->frame_size);
+      return NULL;
+    }
+
+  frame_fingerprint (session, frame, depth, generation);
+
+  g_mutex_lock (&session->lock);
+  if (generation != session->generation)
+    {
+      /* Rotated for a rotation that is gone, only lend it */
+      if (resident)
+        {
+          memory_uncharge (MEMORY_FRAMES, session->frame_size);
+          memory_charge (MEMORY_LENT, session->frame_size);
+        }
+    }
+  else if (frame->depth != NULL)
+    {
+      g_slice_free1 (session->frame_size, depth);
+      memory_uncharge (resident ? MEMORY_FRAMES : MEMORY_LENT,
+                       session->frame_size);
+      depth = frame->depth;
+      frame->users++;
+    }
+  else if (resident)
+    {
+      frame->depth = depth;
+      frame->users++;
+    }
+  g_mutex_unlock (&session->lock);
+
+  return depth;
+}
+
+static void
+session_release_depth (Session *session, Frame *frame, guint16 *depth)
+{
+  gboolean resident;
+
+  g_mutex_lock (&session->lock);
+  if (frame->source != NULL)
+    frame = frame->source;
+  resident = depth == frame->depth;
+  if (resident)
+    frame->users--;
+  g_mutex_unlock (&session->lock);
+
+  if (! resident)
+    {
+      g_slice_free1 (session->frame_size, depth);
+      memory_uncharge (MEMORY_LENT, session->frame_size);
+    }
+}
+
+static void
+load_frame (Job *job)
+{
+  Session *session = job->session;
+  Frame *frame = job->frame;
+  guint16 *depth;
+  guint generation;
+  gboolean shared;
+
+  g_mutex_lock (&session->lock);
+  shared = frame->source != NULL;
+  g_mutex_unlock (&session->lock);
+
+  /* Prefetching never evicts, the frames that do not fit are read on
+     demand instead */
+  if (shared || ! memory_try_charge (MEMORY_FRAMES, session->frame_size))
+    return;
+
+  g_mutex_lock (&session->lock);
+  depth = frame->depth;
+  g_mutex_unlock (&session->lock);
+
+  if (depth == NULL)
+    {
+      depth = session_read_depth (session, frame, &generation);
+      if (depth != NULL)
+        {
+          frame_fingerprint (session, frame, depth, generation);
+
+          g_mutex_lock (&session->lock);
+          if (frame->depth == NULL && frame->source == NULL &&
+              generation == session->generation)
+            {
+              frame->depth = depth;
+              depth = NULL;
+            }
+          g_mutex_unlock (&session->lock);
+
+          if (depth == NULL)
+            return;
+
+          g_slice_free1 (session->frame_size, depth);
+        }
+    }
+
+  memory_uncharge (MEMORY_FRAMES, session->frame_size);
+}
+
+static gboolean
+on_fingerprints_done (gpointer data);
+
+static void
+fingerprint_frame (Job *job)
+{
+  Session *session = job->session;
+  guint16 *depth;
+
+  depth = session_get_depth (session, job->frame, TRUE);
+  if (depth != NULL)
+    {
+      /* The rotation does not change while tracking */
+      frame_fingerprint (session, job->frame, depth, session->generation);
+      session_release_depth (session, job->frame, depth);
+    }
+
+  if (g_atomic_int_dec_and_test (&session->pending_fingerprints))
+    g_idle_add (on_fingerprints_done, session);
+}
+
+static gboolean
+on_tracking_done (gpointer data);
+
+static SkeltrackJointList
+copy_pose (SkeltrackJointList pose)
+{
+  SkeltrackJointList copy;
+  gint i;
+
+  if (pose == NULL)
+    return NULL;
+
+  copy = skeltrack_joint_list_new ();
+  for (i = 0; i < SKELTRACK_JOINT_MAX_JOINTS; i++)
+    {
+      if (pose[i] != NULL)
+        copy[i] = skeltrack_joint_copy (pose[i]);
+    }
+
+  return copy;
+}
+
+/* Gives the duplicate frames that follow the key frame of @job a copy
+   of its @pose, and publishes them, as soon as the pose is known */
+static void
+copy_pose_to_duplicates (Job *job, SkeltrackJointList pose)
+{
+  Session *session = job->session;
+  GList *frame_node = g_list_next (job->frame_node);
+  GList *node = g_list_next (job->skeleton_node);
+
+  for (; frame_node != NULL;
+       frame_node = g_list_next (frame_node), node = g_list_next (node))
+    {
+      Frame *frame = (Frame *) frame_node->data;
+      SkeltrackJointList copy;
+      gboolean duplicate;
+
+      g_mutex_lock (&session->lock);
+      duplicate = frame->duplicate;
+      g_mutex_unlock (&session->lock);
+
+      if (! duplicate)
+        break;
+
+      copy = copy_pose (pose);
+      if (copy != NULL)
+        memory_charge (MEMORY_POSES, POSE_SIZE);
+
+      g_mutex_lock (&session->lock);
+      node->data = copy;
+      g_mutex_unlock (&session->lock);
+
+      joint_stream_publish (session->id, frame->index, copy);
+    }
+}
+
+/* Queues the key frame after the one of @job, with the same tracking
+   parameters */
+static void
+track_next_key_frame (Job *job)
+{
+  Session *session = job->session;
+  GList *frame_node = g_list_next (job->frame_node);
+  GList *node = g_list_next (job->skeleton_node);
+  Job *next;
+
+  g_mutex_lock (&session->lock);
+  while (frame_node != NULL && ((Frame *) frame_node->data)->duplicate)
+    {
+      frame_node = g_list_next (frame_node);
+      node = g_list_next (node);
+    }
+  g_mutex_unlock (&session->lock);
+
+  if (frame_node == NULL)
+    return;
+
+  next = g_slice_dup (Job, job);
+  next->frame = (Frame *) frame_node->data;
+  next->frame_node = frame_node;
+  next->skeleton_node = node;
+
+  g_mutex_lock (&worker_pool.lock);
+  if (worker_pool.shutting_down)
+    g_slice_free (Job, next);
+  else
+    g_thread_pool_push (worker_pool.pool, next, NULL);
+  g_mutex_unlock (&worker_pool.lock);
+}
+
+static void
+track_frame (Job *job)
+{
+  Session *session = job->session;
+  SkeltrackSkeleton *frame_skeleton;
+  SkeltrackJointList pose;
+  BufferInfo *buffer_info;
+  GError *error = NULL;
+  guint16 *depth;
+  gsize reduced_size;
+  gint64 start;
+
+  reduced_size = (job->width / job->dimension_reduction) *
+    (job->height / job->dimension_reduction) * sizeof (guint16);
+  memory_reserve (MEMORY_SCRATCH, reduced_size);
+
+  depth = session_get_depth (session, job->frame, TRUE);
+  if (depth != NULL)
+    {
+      start = g_get_monotonic_time ();
+      buffer_info = process_buffer (depth,
+                                    job->width,
+                                    job->height,
+                                    job->dimension_reduction,
+                                    job->threshold_begin,
+                                    job->threshold_end);
+      stage_record (STAGE_REDUCE, start);
+      session_release_depth (session, job->frame, depth);
+
+      start = g_get_monotonic_time ();
+      if (session->tracker != NULL)
+        frame_skeleton = g_object_ref (session->tracker);
+      else
+        frame_skeleton = SKELTRACK_SKELETON (skeltrack_skeleton_new ());
+      pose = skeltrack_skeleton_track_joints_sync (frame_skeleton,
+                                               buffer_info->reduced_buffer,
+                                               buffer_info->reduced_width,
+                                               buffer_info->reduced_height,
+                                               NULL,
+                                               &error);
+      g_object_unref (frame_skeleton);
+      stage_record (STAGE_TRACK, start);
+
+      if (error != NULL)
+        {
+          g_debug ("ERROR: %s", error->message);
+          g_clear_error (&error);
+        }
+
+      if (pose != NULL)
+        memory_charge (MEMORY_POSES, POSE_SIZE);
+
+      g_mutex_lock (&session->lock);
+      job->skeleton_node->data = pose;
+      g_mutex_unlock (&session->lock);
+
+      joint_stream_publish (session->id, job->frame->index, pose);
+      copy_pose_to_duplicates (job, pose);
+
+      g_slice_free1 (buffer_info->reduced_width *
+                     buffer_info->reduced_height * sizeof (guint16),
+                     buffer_info->reduced_buffer);
+      g_slice_free (BufferInfo, buffer_info);
+    }
+
+  memory_uncharge (MEMORY_SCRATCH, reduced_size);
+
+  if (session->tracker != NULL)
+    track_next_key_frame (job);
+
+  if (g_atomic_int_dec_and_test (&session->pending_tracks))
+    g_idle_add (on_tracking_done, session);
+}
+
+static gboolean
+on_first_frame_loaded (gpointer data);
+
+static void
+run_job (gpointer data, gpointer user_data)
+{
+  Job *job = (Job *) data;
+  gboolean shutting_down;
+
+  g_mutex_lock (&worker_pool.lock);
+  shutting_down = worker_pool.shutting_down;
+  g_mutex_unlock (&worker_pool.lock);
+
+  if (shutting_down)
+    {
+      g_slice_free (Job, job);
+      return;
+    }
+
+  switch (job->type)
+    {
+    case JOB_LOAD:
+      load_frame (job);
+      /* Frames that did not fit are read on demand, so the first one
+         can be painted either way */
+      if (job->frame->index == 0)
+        g_idle_add (on_first_frame_loaded, job->session);
+      break;
+    case JOB_FINGERPRINT:
+      fingerprint_frame (job);
+      break;
+    case JOB_TRACK:
+      track_frame (job);
+      break;
+    }
+
+  g_slice_free (Job, job);
+}
+
+/* Jobs of the active session go first, tracking before prefetching,
+   and then in frame order */
+static gint
+compare_jobs (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const Job *job_a = (const Job *) a;
+  const Job *job_b = (const Job *) b;
+
+  gint priority_a = g_atomic_int_get (&job_a->session->priority);
+  gint priority_b = g_atomic_int_get (&job_b->session->priority);
+
+  if (priority_a != priority_b)
+    return priority_b - priority_a;
+
+  if (job_a->type != job_b->type)
+    return job_b->type - job_a->type;
+
+  return (gint) job_a->frame->index - (gint) job_b->frame->index;
+}
+
+static void
+init_worker_pool (void)
+{
+  GError *error = NULL;
+
+  worker_pool.pool = g_thread_pool_new (run_job,
+                                        NULL,
+                                        g_get_num_processors (),
+                                        FALSE,
+                                        &error);
+  if (error != NULL)
+    {
+      g_error ("ERROR: %s", error->message);
+    }
+
+  g_thread_pool_set_sort_function (worker_pool.pool, compare_jobs, NULL);
+}
+
+static Session *
+session_new (gchar *directory, gint dimension_reduction)
+{
+  Session *session;
+
+  session = g_slice_new0 (Session);
+  session->directory = g_strdup (directory);
+  session->priority = SESSION_PRIORITY_BACKGROUND;
+  g_mutex_init (&session->lock);
+  session->raw_width = 640;
+  session->raw_height = 480;
+  session->width = session->raw_width;
+  session->height = session->raw_height;
+  session->frame_size = session->raw_width * session->raw_height *
+    sizeof (guint16);
+  session->dimension_reduction = dimension_reduction;
+  session->threshold_end = THRESHOLD_END;
+
+  return session;
+}
+
+static void
+session_free (Session *session)
+{
+  GList *node;
+
+  for (node = session->frame_list; node != NULL; node = g_list_next (node))
+    {
+      Frame *frame = (Frame *) node->data;
+      if (frame->depth != NULL)
+        g_slice_free1 (session->frame_size, frame->depth);
+      frame_free_fingerprint (frame);
+      g_slice_free (Frame, frame);
+    }
+  g_list_free (session->frame_list);
+  g_list_free_full (session->skeleton_list,
+                    (GDestroyNotify) skeltrack_joint_list_free);
+  g_list_free_full (session->frame_path_list, g_free);
+  g_mutex_clear (&session->lock);
+  g_free (session->directory);
+  g_slice_free (Session, session);
+}
+
+static gboolean
+rotation_from_degrees (gint degrees, Rotation *rotation)
+{
+  switch (degrees)
+    {
+    case 0:
+      *rotation = ROTATION_0;
+      return TRUE;
+    case 90:
+      *rotation = ROTATION_90;
+      return TRUE;
+    case 180:
+      *rotation = ROTATION_180;
+      return TRUE;
+    case 270:
+      *rotation = ROTATION_270;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Changes the rotation of the frames of @session. Everything derived
+   from the old frames, that is resident buffers, fingerprints and poses,
+   is dropped and the frames are read again. */
+static void
+session_set_rotation (Session *session, Rotation rotation, gboolean mirror)
+{
+  GList *node;
+
+  g_mutex_lock (&session->lock);
+  session->rotation = rotation;
+  session->mirror = mirror;
+  session->generation++;
+
+  if (rotation == ROTATION_90 || rotation == ROTATION_270)
+    {
+      session->width = session->raw_height;
+      session->height = session->raw_width;
+    }
+  else
+    {
+      session->width = session->raw_width;
+      session->height = session->raw_height;
+    }
+
+  for (node = session->frame_list; node != NULL; node = g_list_next (node))
+    {
+      Frame *frame = (Frame *) node->data;
+
+      if (frame->depth != NULL && frame->users == 0)
+        {
+          g_slice_free1 (session->frame_size, frame->depth);
+          frame->depth = NULL;
+          memory_uncharge (MEMORY_FRAMES, session->frame_size);
+        }
+      frame_free_fingerprint (frame);
+    }
+  g_mutex_unlock (&session->lock);
+
+  for (node = session->skeleton_list; node != NULL; node = g_list_next (node))
+    {
+      if (node->data != NULL)
+        {
+          skeltrack_joint_list_free ((SkeltrackJointList) node->data);
+          memory_uncharge (MEMORY_POSES, POSE_SIZE);
+        }
+      node->data = NULL;
+    }
+}
+
+/* Applies the rotation and mirror given in the RECORDING_METADATA file
+   of the recording, if any */
+static void
+session_load_metadata (Session *session)
+{
+  GKeyFile *key_file;
+  GError *error = NULL;
+  gchar *path;
+  Rotation rotation = session->rotation;
+  gboolean mirror = session->mirror;
+  gint degrees;
+
+  path = g_build_filename (session->directory, RECORDING_METADATA, NULL);
+  key_file = g_key_file_new ();
+
+  if (g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+    {
+      degrees = g_key_file_get_integer (key_file, "recording", "rotation",
+                                        &error);
+      if (error == NULL && ! rotation_from_degrees (degrees, &rotation))
+        g_print ("Ignoring invalid rotation %d in %s\n", degrees, path);
+      g_clear_error (&error);
+
+      mirror = g_key_file_get_boolean (key_file, "recording", "mirror",
+                                       &error);
+      if (error != NULL)
+        mirror = session->mirror;
+      g_clear_error (&error);
+    }
+
+  session_set_rotation (session, rotation, mirror);
+
+  g_key_file_free (key_file);
+  g_free (path);
+}
+
+static void
+first_frame (Session *session);
+
+static void
+read_video (Session *session)
+{
+  GList *path;
+  guint index = 0;
+
+  session->frame_path_list = get_frame_path_list (session->directory);
+
+  for (path = g_list_first (session->frame_path_list);
+       path != NULL;
+       path = g_list_next (path))
+    {
+      Frame *frame = g_slice_new0 (Frame);
+      frame->path = (gchar *) path->data;
+      frame->index = index++;
+
+      session->frame_list = g_list_append (session->frame_list, frame);
+      session->skeleton_list = g_list_append (session->skeleton_list, NULL);
+    }
+
+  for (path = g_list_first (session->frame_list);
+       path != NULL;
+       path = g_list_next (path))
+    {
+      worker_pool_push (session, JOB_LOAD, path, NULL);
+    }
+
+  first_frame (session);
+}
+
+static void
+paint_joint (cairo_t *cairo,
+             SkeltrackJoint *joint,
+             gint radius,
+             const gchar *color_str)
+{
+  ClutterColor *color;
+
+  if (joint == NULL)
+    return;
+
+  color = clutter_color_new (0, 0, 0, 200);
+  clutter_color_from_string (color, color_str);
+
+  cairo_set_line_width (cairo, 10);
+  clutter_cairo_set_source_color (cairo, color);
+  cairo_arc (cairo,
+             joint->screen_x,
+             joint->screen_y,
+             radius / joint->z,
+             0,
+             G_PI * 2);
+  cairo_fill (cairo);
+  clutter_color_free (color);
+}
+
+static void
+connect_joints (cairo_t *cairo,
+                SkeltrackJoint *joint_a,
+                SkeltrackJoint *joint_b,
+                const gchar *color_str)
+{
+  ClutterColor *color;
+
+  if (joint_a == NULL || joint_b == NULL)
+    return;
+
+  color = clutter_color_new (0, 0, 0, 200);
+  clutter_color_from_string (color, color_str);
+
+  cairo_set_line_width (cairo, 10);
+  clutter_cairo_set_source_color (cairo, color);
+  cairo_move_to (cairo,
+                 joint_a->screen_x,
+                 joint_a->screen_y);
+  cairo_line_to (cairo,
+                 joint_b->screen_x,
+                 joint_b->screen_y);
+  cairo_stroke (cairo);
+  clutter_color_free (color);
+}
+
+static void
+on_texture_draw (ClutterCairoTexture *texture,
+                 cairo_t *cairo,
+                 gpointer user_data)
+{
+  ClutterColor *color;
+  SkeltrackJoint *head, *left_hand, *right_hand,
+    *left_shoulder, *right_shoulder, *left_elbow, *right_elbow;
+  SkeltrackJointList list;
+  GList *current_skeleton = active_session->current_skeleton;
+
+  /* Paint it white, cairo is clipped to the invalidated area */
+  color = clutter_color_new (255, 255, 255, 255);
+  cairo_set_operator (cairo, CAIRO_OPERATOR_SOURCE);
+  clutter_cairo_set_source_color (cairo, color);
+  cairo_paint (cairo);
+  cairo_set_operator (cairo, CAIRO_OPERATOR_OVER);
+  clutter_color_free (color);
+
+  if (current_skeleton == NULL)
+    return;
+
+  list = (SkeltrackJointList) current_skeleton->data;
+  if (list == NULL)
+    return;
+
+  head = skeltrack_joint_list_get_joint (list,
+                                         SKELTRACK_JOINT_ID_HEAD);
+  left_hand = skeltrack_joint_list_get_joint (list,
+                                              SKELTRACK_JOINT_ID_LEFT_HAND);
+  right_hand = skeltrack_joint_list_get_joint (list,
+                                               SKELTRACK_JOINT_ID_RIGHT_HAND);
+  left_shoulder = skeltrack_joint_list_get_joint (list,
+                                       SKELTRACK_JOINT_ID_LEFT_SHOULDER);
+  right_shoulder = skeltrack_joint_list_get_joint (list,
+                                       SKELTRACK_JOINT_ID_RIGHT_SHOULDER);
+  left_elbow = skeltrack_joint_list_get_joint (list,
+                                               SKELTRACK_JOINT_ID_LEFT_ELBOW);
+  right_elbow = skeltrack_joint_list_get_joint (list,
+                                                SKELTRACK_JOINT_ID_RIGHT_ELBOW);
+
+  paint_joint (cairo, head, 50000, "#FFF800");
+
+  connect_joints (cairo, left_shoulder, right_shoulder, "#afafaf");
+
+  connect_joints (cairo, left_shoulder, left_elbow, "#afafaf");
+
+  connect_joints (cairo, right_shoulder, right_elbow, "#afafaf");
+
+  connect_joints (cairo, right_hand, right_elbow, "#afafaf");
+
+  connect_joints (cairo, left_hand, left_elbow, "#afafaf");
+
+  paint_joint (cairo, left_hand, 30000, "#C2FF00");
+
+  paint_joint (cairo, right_hand, 30000, "#00FAFF");
+}
+
+static void
+set_info_text (void)
+{
+  gchar *title;
+  gchar *frame_file_name;
+  Session *session = active_session;
+  gsize usage[MEMORY_LAST];
+  gsize total;
+  guint evictions;
+
+  g_mutex_lock (&memory.lock);
+  memcpy (usage, memory.usage, sizeof (usage));
+  total = memory.total;
+  evictions = memory.evictions;
+  g_mutex_unlock (&memory.lock);
+
+  frame_file_name = (gchar *) g_list_nth_data (session->frame_path_list,
+                                               session->current_frame_number-1);
+
+  title = g_strdup_printf( "<b>Threshold:</b> %d\t\t\t\t"
+                           "<b>Frame:</b> %d - %s\n"
+                           "<b>Smoothing Enabled:</b> %s\t\t\t"
+                           "<b>Smoothing Level:</b> %.2f\t\t\t\n"
+                           "<b>Recording:</b> %d/%d - %s%s\t\t"
+                           "<b>Rotation:</b> %d%s\n"
+                           "<b>Memory:</b> %.1f/%.1f MB "
+                           "(frames %.1f, renders %.1f, poses %.1f, "
+                           "scratch %.1f, %u evictions)",
+                           session->threshold_end,
+                           session->current_frame_number,
+                           frame_file_name? frame_file_name : "",
+                           ENABLE_SMOOTHING ? "Yes" : "No",
+                           SMOOTHING_FACTOR,
+                           g_list_index (session_list, session) + 1,
+                           g_list_length (session_list),
+                           session->directory,
+                           session->tracking ? " (tracking...)" : "",
+                           session->rotation * 90,
+                           session->mirror ? " mirrored" : "",
+                           total / (1024. * 1024.),
+                           memory.limit / (1024. * 1024.),
+                           usage[MEMORY_FRAMES] / (1024. * 1024.),
+                           usage[MEMORY_RENDERS] / (1024. * 1024.),
+                           usage[MEMORY_POSES] / (1024. * 1024.),
+                           (usage[MEMORY_SCRATCH] + usage[MEMORY_LENT]) /
+                           (1024. * 1024.),
+                           evictions
+                           );
+  clutter_text_set_markup (CLUTTER_TEXT (info_text), title);
+  g_free (title);
+}
+
+static void
+set_threshold (gint difference)
+{
+  gint new_threshold = active_session->threshold_end + difference;
+  if (new_threshold >= THRESHOLD_BEGIN + 300 &&
+      new_threshold <= 8000)
+    active_session->threshold_end = new_threshold;
+}
+
+static void
+enable_smoothing (gboolean enable)
+{
+  if (skeleton != NULL)
+    g_object_set (skeleton, "enable-smoothing", enable, NULL);
+}
+
+static void
+set_smoothing_factor (gfloat factor)
+{
+  if (skeleton != NULL)
+    {
+      SMOOTHING_FACTOR += factor;
+      SMOOTHING_FACTOR = CLAMP (SMOOTHING_FACTOR, 0.0, 1.0);
+      g_object_set (skeleton, "smoothing-factor", SMOOTHING_FACTOR, NULL);
+    }
+}
+
+static void
+rect_union (cairo_rectangle_int_t *area, const cairo_rectangle_int_t *other)
+{
+  gint x2, y2;
+
+  if (other->width <= 0 || other->height <= 0)
+    return;
+
+  if (area->width <= 0 || area->height <= 0)
+    {
+      *area = *other;
+      return;
+    }
+
+  x2 = MAX (area->x + area->width, other->x + other->width);
+  y2 = MAX (area->y + area->height, other->y + other->height);
+  area->x = MIN (area->x, other->x);
+  area->y = MIN (area->y, other->y);
+  area->width = x2 - area->x;
+  area->height = y2 - area->y;
+}
+
+static void
+rect_clip (cairo_rectangle_int_t *area, gint width, gint height)
+{
+  gint x2 = MIN (area->x + area->width, width);
+  gint y2 = MIN (area->y + area->height, height);
+
+  area->x = MAX (area->x, 0);
+  area->y = MAX (area->y, 0);
+  area->width = MAX (x2 - area->x, 0);
+  area->height = MAX (y2 - area->y, 0);
+}
+
+static void
+add_point_area (GArray *areas, SkeltrackJoint *joint)
+{
+  cairo_rectangle_int_t area;
+
+  if (joint == NULL)
+    return;
+
+  area.x = joint->screen_x - POINT_SIZE;
+  area.y = joint->screen_y - POINT_SIZE;
+  area.width = POINT_SIZE * 2;
+  area.height = POINT_SIZE * 2;
+  rect_clip (&area, display.width, display.height);
+
+  if (area.width > 0 && area.height > 0)
+    g_array_append_val (areas, area);
+}
+
+static void
+display_reset (gint width, gint height, guint threshold)
+{
+  gsize size = display.width * display.height * 3;
+
+  if (display.render != NULL)
+    {
+      g_slice_free1 (size, display.render);
+      g_slice_free1 (size, display.buffer);
+      memory_uncharge (MEMORY_RENDERS, size * 2);
+      g_free (display.hashes);
+      g_free (display.dirty_blocks);
+    }
+
+  if (display.points == NULL)
+    display.points = g_array_new (FALSE, FALSE,
+                                  sizeof (cairo_rectangle_int_t));
+  g_array_set_size (display.points, 0);
+
+  display.width = width;
+  display.height = height;
+  display.threshold = threshold;
+  size = width * height * 3;
+  display.render = g_slice_alloc (size);
+  display.buffer = g_slice_alloc (size);
+  memory_charge (MEMORY_RENDERS, size * 2);
+
+  display.n_blocks = (width / FINGERPRINT_BLOCK) *
+    (height / FINGERPRINT_BLOCK);
+  display.hashes = g_new (guint32, display.n_blocks);
+  display.dirty_blocks = g_new (guint8, display.n_blocks);
+  display.hashes_valid = FALSE;
+
+  display.valid = TRUE;
+  display.uploaded = FALSE;
+}
+
+/* Cuts @area of @depth at the display threshold and writes it to the
+   grayscale render, white where nothing is in range */
+static void
+display_render_area (guint16 *depth, cairo_rectangle_int_t *area)
+{
+  gint i, j;
+
+  for (j = area->y; j < area->y + area->height; j++)
+    {
+      for (i = area->x; i < area->x + area->width; i++)
+        {
+          gint index = j * display.width + i;
+          guint16 value = depth[index];
+          guint16 gray = 0;
+
+          if (value >= THRESHOLD_BEGIN && value <= display.threshold)
+            gray = round (value * 256. / 3000.);
+
+          grayscale_buffer_set_value (display.render, index,
+                                      gray != 0 ? gray : 255);
+        }
+    }
+}
+
+/* Marks the blocks of @frame whose hash differs from the one on screen
+   and takes its hashes as the ones on screen. Without hashes to compare
+   every block is dirty. Returns whether any block is. */
+static gboolean
+display_find_dirty_blocks (Session *session, Frame *frame)
+{
+  gboolean compared = FALSE;
+  gboolean any_dirty = FALSE;
+  guint i;
+
+  g_mutex_lock (&session->lock);
+  if (display.hashes_valid && frame->fingerprinted &&
+      frame->n_blocks == display.n_blocks)
+    {
+      for (i = 0; i < display.n_blocks; i++)
+        {
+          display.dirty_blocks[i] = display.hashes[i] !=
+            frame->block_hashes[i];
+          display.hashes[i] = frame->block_hashes[i];
+          any_dirty |= display.dirty_blocks[i];
+        }
+      compared = TRUE;
+    }
+  g_mutex_unlock (&session->lock);
+
+  if (compared)
+    return any_dirty;
+
+  memset (display.dirty_blocks, 1, display.n_blocks);
+  display.hashes_valid = FALSE;
+
+  return TRUE;
+}
+
+/* Takes the block hashes of @frame, if it has been fingerprinted by
+   now, as the ones of what is on screen */
+static void
+display_take_hashes (Session *session, Frame *frame)
+{
+  g_mutex_lock (&session->lock);
+  display.hashes_valid = frame->fingerprinted &&
+    frame->n_blocks == display.n_blocks;
+  if (display.hashes_valid)
+    memcpy (display.hashes, frame->block_hashes,
+            display.n_blocks * sizeof (guint32));
+  g_mutex_unlock (&session->lock);
+}
+
+/* Brings the render up to date with @frame. Only the FINGERPRINT_BLOCK
+   squares whose content changed since the frame on screen are cut and
+   converted, so a frame that did not change does not even need its
+   depth buffer. Appends the areas that changed to @dirty, one per row
+   of blocks, plus the borders that blocks do not cover. */
+static gboolean
+display_update (Session *session, Frame *frame, GArray *dirty)
+{
+  gint blocks_width = session->width / FINGERPRINT_BLOCK;
+  gint blocks_height = session->height / FINGERPRINT_BLOCK;
+  cairo_rectangle_int_t borders[2];
+  guint16 *depth;
+  gint64 start;
+  gint x, y, i;
+
+  if (! display.valid ||
+      display.width != session->width ||
+      display.height != session->height ||
+      display.threshold != session->threshold_end)
+    display_reset (session->width, session->height, session->threshold_end);
+
+  /* Right and bottom borders narrower than a block */
+  borders[0].x = blocks_width * FINGERPRINT_BLOCK;
+  borders[0].y = 0;
+  borders[0].width = display.width - borders[0].x;
+  borders[0].height = display.height;
+  borders[1].x = 0;
+  borders[1].y = blocks_height * FINGERPRINT_BLOCK;
+  borders[1].width = borders[0].x;
+  borders[1].height = display.height - borders[1].y;
+
+  if (! display_find_dirty_blocks (session, frame) &&
+      borders[0].width == 0 && borders[1].height == 0)
+    return TRUE;
+
+  depth = session_get_depth (session, frame, FALSE);
+  if (depth == NULL)
+    {
+      display.valid = FALSE;
+      return FALSE;
+    }
+
+  start = g_get_monotonic_time ();
+
+  for (y = 0; y < blocks_height; y++)
+    {
+      cairo_rectangle_int_t area = { 0, y * FINGERPRINT_BLOCK,
+                                     0, FINGERPRINT_BLOCK };
+
+      for (x = 0; x < blocks_width; x++)
+        {
+          cairo_rectangle_int_t block = { x * FINGERPRINT_BLOCK,
+                                          y * FINGERPRINT_BLOCK,
+                                          FINGERPRINT_BLOCK,
+                                          FINGERPRINT_BLOCK };
+
+          if (! display.dirty_blocks[y * blocks_width + x])
+            continue;
+
+          display_render_area (depth, &block);
+          rect_union (&area, &block);
+        }
+
+      if (area.width > 0)
+        g_array_append_val (dirty, area);
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      if (borders[i].width > 0 && borders[i].height > 0)
+        {
+          display_render_area (depth, &borders[i]);
+          g_array_append_val (dirty, borders[i]);
+        }
+    }
+
+  stage_record (STAGE_GRAYSCALE, start);
+
+  session_release_depth (session, frame, depth);
+
+  /* Reading the frame fingerprints it if that had not happened yet */
+  if (! display.hashes_valid)
+    display_take_hashes (session, frame);
+
+  return TRUE;
+}
+
+/* Copies @area of the render to the upload buffer, wiping the joints
+   that were drawn there */
+static void
+display_restore (cairo_rectangle_int_t *area)
+{
+  gint rowstride = display.width * 3;
+  gint y;
+
+  for (y = area->y; y < area->y + area->height; y++)
+    {
+      gint offset = y * rowstride + area->x * 3;
+
+      memcpy (display.buffer + offset, display.render + offset,
+              area->width * 3);
+    }
+}
+
+/* Shows the render with the joints of the current pose on depth_tex.
+   Only the @dirty areas of the render, and those of the old and new
+   joints, are repainted and uploaded. */
+static gboolean
+paint_depth (GArray *dirty)
+{
+  gchar *head_color, *left_shoulder_color, *right_shoulder_color,
+        *left_elbow_color, *right_elbow_color, *left_hand_color,
+        *right_hand_color;
+
+  head_color = "#ff0000";
+  left_hand_color = "#00ff00";
+  right_hand_color = "#0000ff";
+  left_elbow_color = "#97FF93";
+  right_elbow_color = "#9094FF";
+  left_shoulder_color = "#125500";
+  right_shoulder_color = "#000045";
+
+  SkeltrackJoint *head, *left_hand, *right_hand,
+    *left_shoulder, *right_shoulder, *left_elbow, *right_elbow;
+  SkeltrackJointList list = NULL;
+  GList *current_skeleton = active_session->current_skeleton;
+  guint width = display.width;
+  guint height = display.height;
+  guchar *buffer = display.buffer;
+  gint64 start;
+  guint i;
+
+  head = left_hand = right_hand = NULL;
+  left_shoulder = right_shoulder = left_elbow = right_elbow = NULL;
+
+  if (current_skeleton != NULL)
+    list = (SkeltrackJointList) current_skeleton->data;
+
+  if (list != NULL)
+    {
+      head = skeltrack_joint_list_get_joint (list,
+                                             SKELTRACK_JOINT_ID_HEAD);
+      left_hand = skeltrack_joint_list_get_joint (list,
+                                                  SKELTRACK_JOINT_ID_LEFT_HAND);
+      right_hand = skeltrack_joint_list_get_joint (list,
+                                                   SKELTRACK_JOINT_ID_RIGHT_HAND);
+      left_shoulder = skeltrack_joint_list_get_joint (list,
+                                           SKELTRACK_JOINT_ID_LEFT_SHOULDER);
+      right_shoulder = skeltrack_joint_list_get_joint (list,
+                                           SKELTRACK_JOINT_ID_RIGHT_SHOULDER);
+      left_elbow = skeltrack_joint_list_get_joint (list,
+                                                   SKELTRACK_JOINT_ID_LEFT_ELBOW);
+      right_elbow = skeltrack_joint_list_get_joint (list,
+                                                    SKELTRACK_JOINT_ID_RIGHT_ELBOW);
+    }
+
+  start = g_get_monotonic_time ();
+
+  g_array_append_vals (dirty, display.points->data, display.points->len);
+
+  g_array_set_size (display.points, 0);
+  add_point_area (display.points, head);
+  add_point_area (display.points, left_hand);
+  add_point_area (display.points, right_hand);
+  add_point_area (display.points, left_shoulder);
+  add_point_area (display.points, right_shoulder);
+  add_point_area (display.points, left_elbow);
+  add_point_area (display.points, right_elbow);
+  g_array_append_vals (dirty, display.points->data, display.points->len);
+
+  for (i = 0; i < dirty->len; i++)
+    display_restore (&g_array_index (dirty, cairo_rectangle_int_t, i));
+
+  if (head)
+    draw_point (buffer, width, height, head_color, head->screen_x,
         head->screen_y);
   if (left_hand)
     draw_point (buffer, width, height, left_hand_color, left_hand->screen_x,
@@ -489,233 +1964,1036 @@ paint_depth (guchar *buffer, guint width, guint height)
         right_elbow->screen_y);
   GError *error = NULL;
 
-  if (! clutter_texture_set_from_rgb_data (CLUTTER_TEXTURE (depth_tex),
-        buffer,
-        FALSE,
-        width, height,
-        0,
-        3,
-        CLUTTER_TEXTURE_NONE,
-        &error))
+  stage_record (STAGE_PAINT, start);
+  start = g_get_monotonic_time ();
+
+  if (! display.uploaded)
+    {
+      if (! clutter_texture_set_from_rgb_data (CLUTTER_TEXTURE (depth_tex),
+            buffer,
+            FALSE,
+            width, height,
+            0,
+            3,
+            CLUTTER_TEXTURE_NONE,
+            &error))
+      {
+        g_debug ("Error setting texture area: %s", error->message);
+        g_error_free (error);
+        display.valid = FALSE;
+        return FALSE;
+      }
+      display.uploaded = TRUE;
+    }
+  else
+    {
+      for (i = 0; i < dirty->len; i++)
+        {
+          cairo_rectangle_int_t *area =
+            &g_array_index (dirty, cairo_rectangle_int_t, i);
+
+          if (! clutter_texture_set_area_from_rgb_data (
+                CLUTTER_TEXTURE (depth_tex),
+                buffer + (area->y * width + area->x) * 3,
+                FALSE,
+                area->x, area->y,
+                area->width, area->height,
+                width * 3,
+                3,
+                CLUTTER_TEXTURE_NONE,
+                &error))
+          {
+            g_debug ("Error setting texture area: %s", error->message);
+            g_error_free (error);
+            display.valid = FALSE;
+            return FALSE;
+          }
+        }
+    }
+
+  stage_record (STAGE_UPLOAD, start);
+
+  return TRUE;
+}
+
+/* Bounds of what on_texture_draw () paints for @list: the joint
+   circles and the 10 pixel wide bones between them */
+static gboolean
+pose_bounds (SkeltrackJointList list, cairo_rectangle_int_t *bounds)
+{
+  gint i;
+
+  bounds->x = bounds->y = bounds->width = bounds->height = 0;
+
+  if (list == NULL)
+    return FALSE;
+
+  for (i = 0; i < SKELTRACK_JOINT_MAX_JOINTS; i++)
+    {
+      SkeltrackJoint *joint = skeltrack_joint_list_get_joint (list, i);
+      cairo_rectangle_int_t area;
+      gint margin;
+
+      if (joint == NULL)
+        continue;
+
+      margin = 50000 / MAX (joint->z, 1) + 6;
+      area.x = joint->screen_x - margin;
+      area.y = joint->screen_y - margin;
+      area.width = margin * 2;
+      area.height = margin * 2;
+      rect_union (bounds, &area);
+    }
+
+  return bounds->width > 0;
+}
+
+/* Redraws the parts of skeleton_tex covered by the previous and the
+   current pose */
+static void
+invalidate_skeleton (void)
+{
+  cairo_rectangle_int_t area, previous;
+  SkeltrackJointList list = NULL;
+
+  if (active_session->current_skeleton != NULL)
+    list = (SkeltrackJointList) active_session->current_skeleton->data;
+
+  previous = display.skeleton_area;
+  pose_bounds (list, &area);
+  rect_clip (&area, active_session->width, active_session->height);
+  display.skeleton_area = area;
+
+  if (! display.skeleton_valid)
+    {
+      clutter_cairo_texture_invalidate (CLUTTER_CAIRO_TEXTURE (skeleton_tex));
+      display.skeleton_valid = TRUE;
+      return;
+    }
+
+  rect_union (&area, &previous);
+  if (area.width > 0 && area.height > 0)
+    clutter_cairo_texture_invalidate_rectangle (
+        CLUTTER_CAIRO_TEXTURE (skeleton_tex), &area);
+}
+
+/* Marks the frames that are near duplicates of the last key frame,
+   sharing the depth buffer of exact copies of the previous frame, and
+   tracks the rest. Comparing with the key frame rather than the
+   previous one keeps a slow movement from drifting unnoticed. */
+static void
+track_key_frames (Session *session)
+{
+  GList *frame_node, *node;
+  Frame *previous = NULL;
+  Frame *key = NULL;
+
+  session->skipped_frames = 0;
+  session->pending_tracks = 0;
+
+  for (frame_node = g_list_first (session->frame_list);
+       frame_node != NULL;
+       frame_node = g_list_next (frame_node))
+    {
+      Frame *frame = (Frame *) frame_node->data;
+      gboolean duplicate;
+      guint16 *depth = NULL;
+
+      g_mutex_lock (&session->lock);
+      duplicate = key != NULL && frame_is_near_duplicate (key, frame);
+      frame->duplicate = duplicate;
+      if (duplicate && frame->source == NULL && frame->users == 0 &&
+          frame->hash == previous->hash)
+        {
+          Frame *source = previous->source != NULL ?
+            previous->source : previous;
+
+          /* Equal hashes do not prove the frames are the same, only
+             share buffers that are both resident and compare equal */
+          if (frame->depth != NULL && source->depth != NULL &&
+              memcmp (frame->depth, source->depth,
+                      session->frame_size) == 0)
+            {
+              depth = frame->depth;
+              frame->depth = NULL;
+              frame->source = source;
+            }
+        }
+      g_mutex_unlock (&session->lock);
+
+      if (depth != NULL)
+        {
+          g_slice_free1 (session->frame_size, depth);
+          memory_uncharge (MEMORY_FRAMES, session->frame_size);
+        }
+
+      if (duplicate)
+        {
+          session->skipped_frames++;
+        }
+      else
+        {
+          session->pending_tracks++;
+          key = frame;
+        }
+
+      previous = frame;
+    }
+
+  if (ENABLE_SMOOTHING)
+    {
+      session->tracker = SKELTRACK_SKELETON (skeltrack_skeleton_new ());
+      g_object_set (session->tracker,
+                    "enable-smoothing", TRUE,
+                    "smoothing-factor", SMOOTHING_FACTOR,
+                    NULL);
+    }
+
+  /* A smoothed run only queues the first key frame, each one queues
+     the next when it is done */
+  for (frame_node = g_list_first (session->frame_list),
+         node = g_list_first (session->skeleton_list);
+       frame_node != NULL;
+       frame_node = g_list_next (frame_node), node = g_list_next (node))
+    {
+      Frame *frame = (Frame *) frame_node->data;
+
+      if (frame->duplicate)
+        continue;
+
+      worker_pool_push (session, JOB_TRACK, frame_node, node);
+      if (session->tracker != NULL)
+        break;
+    }
+}
+
+static gboolean
+on_fingerprints_done (gpointer data)
+{
+  track_key_frames ((Session *) data);
+
+  return FALSE;
+}
+
+static void
+track_video (Session *session)
+{
+  GList *frame, *node;
+  GList *unfingerprinted = NULL;
+
+  if (session->tracking)
+    return;
+
+  for (node = g_list_first (session->skeleton_list);
+       node != NULL;
+       node = g_list_next (node))
+    {
+      if (node->data != NULL)
+        {
+          skeltrack_joint_list_free ((SkeltrackJointList) node->data);
+          memory_uncharge (MEMORY_POSES, POSE_SIZE);
+        }
+      node->data = NULL;
+    }
+
+  session->current_skeleton = NULL;
+  if (session->frame_list == NULL)
+    return;
+
+  session->tracking = TRUE;
+  session->track_start = g_get_monotonic_time ();
+
+  /* Frames that have not been read yet need a fingerprint before
+     duplicates can be told apart */
+  g_mutex_lock (&session->lock);
+  for (frame = g_list_first (session->frame_list);
+       frame != NULL;
+       frame = g_list_next (frame))
+    {
+      if (! ((Frame *) frame->data)->fingerprinted)
+        unfingerprinted = g_list_prepend (unfingerprinted, frame);
+    }
+  g_mutex_unlock (&session->lock);
+
+  if (unfingerprinted == NULL)
+    {
+      track_key_frames (session);
+      return;
+    }
+
+  session->pending_fingerprints = g_list_length (unfingerprinted);
+  for (frame = unfingerprinted; frame != NULL; frame = g_list_next (frame))
+    worker_pool_push (session, JOB_FINGERPRINT, (GList *) frame->data, NULL);
+  g_list_free (unfingerprinted);
+}
+
+static void
+first_frame (Session *session)
+{
+  session->current_skeleton = g_list_first (session->skeleton_list);
+  session->current_frame = g_list_first (session->frame_list);
+  session->current_frame_number = 1;
+}
+
+static void
+last_frame (Session *session)
+{
+  session->current_skeleton = g_list_last (session->skeleton_list);
+  session->current_frame = g_list_last (session->frame_list);
+  session->current_frame_number = g_list_length (session->frame_list);
+}
+
+static gboolean
+next_frame (Session *session)
+{
+  GList *next_skeleton, *next_frame;
+
+  next_skeleton = g_list_next (session->current_skeleton);
+  next_frame = g_list_next (session->current_frame);
+
+  if (next_skeleton != NULL && next_frame != NULL)
+    {
+      session->current_skeleton = next_skeleton;
+      session->current_frame = next_frame;
+      session->current_frame_number++;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+previous_frame (Session *session)
+{
+  GList *previous_skeleton, *previous_frame;
+
+  previous_skeleton = g_list_previous (session->current_skeleton);
+  previous_frame = g_list_previous (session->current_frame);
+
+  if (previous_skeleton != NULL && previous_frame != NULL)
+    {
+      session->current_skeleton = previous_skeleton;
+      session->current_frame = previous_frame;
+      session->current_frame_number--;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+seek_frame (Session *session, guint number)
+{
+  if (number < 1 || number > g_list_length (session->frame_list))
+    return FALSE;
+
+  session->current_frame = g_list_nth (session->frame_list, number - 1);
+  session->current_skeleton = g_list_nth (session->skeleton_list, number - 1);
+  session->current_frame_number = number;
+
+  return TRUE;
+}
+
+static void
+paint_frame ()
+{
+  Session *session = active_session;
+  GArray *dirty;
+  gint64 frame_start;
+
+  if (session->current_frame == NULL)
+    return;
+
+  frame_start = g_get_monotonic_time ();
+
+  dirty = g_array_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t));
+  if (display_update (session, (Frame *) session->current_frame->data, dirty))
+    paint_depth (dirty);
+  g_array_free (dirty, TRUE);
+
+  invalidate_skeleton ();
+
+  stage_record (STAGE_FRAME, frame_start);
+}
+
+static gboolean
+on_first_frame_loaded (gpointer data)
+{
+  Session *session = (Session *) data;
+
+  if (session == active_session &&
+      session->current_frame == g_list_first (session->frame_list))
+    paint_frame ();
+
+  return FALSE;
+}
+
+static void
+control_notify_tracking_done (Session *session);
+
+static gboolean
+on_tracking_done (gpointer data)
+{
+  Session *session = (Session *) data;
+
+  g_clear_object (&session->tracker);
+  session->tracking = FALSE;
+  g_print ("Tracked %d frames of %s in %.3f s, %u duplicates skipped\n",
+           g_list_length (session->frame_list),
+           session->directory,
+           (g_get_monotonic_time () - session->track_start) /
+           (gdouble) G_USEC_PER_SEC,
+           session->skipped_frames);
+
+  control_notify_tracking_done (session);
+
+  first_frame (session);
+  if (session == active_session)
+    {
+      paint_frame ();
+      set_info_text ();
+    }
+
+  return FALSE;
+}
+
+/* Rotates the frames of @session, which cannot be done while it is
+   being tracked */
+static gboolean
+rotate_video (Session *session, Rotation rotation, gboolean mirror)
+{
+  GList *frame;
+
+  if (session->tracking)
+    return FALSE;
+
+  session_set_rotation (session, rotation, mirror);
+
+  for (frame = g_list_first (session->frame_list);
+       frame != NULL;
+       frame = g_list_next (frame))
+    {
+      worker_pool_push (session, JOB_LOAD, frame, NULL);
+    }
+
+  if (session == active_session)
+    {
+      set_orientation ();
+      paint_frame ();
+    }
+
+  return TRUE;
+}
+
+static void
+set_active_session (Session *session)
+{
+  if (active_session != NULL)
+    g_atomic_int_set (&active_session->priority,
+                      SESSION_PRIORITY_BACKGROUND);
+
+  active_session = session;
+  g_atomic_int_set (&active_session->priority, SESSION_PRIORITY_ACTIVE);
+
+  /* The pool only sorts jobs as they are pushed, setting the sort
+     function again sorts those already queued by the new priorities */
+  g_thread_pool_set_sort_function (worker_pool.pool, compare_jobs, NULL);
+
+  set_orientation ();
+  if (active_session->current_skeleton != NULL)
+    paint_frame ();
+}
+
+static gboolean
+on_key_press (ClutterActor *actor,
+              ClutterEvent *event,
+              gpointer data)
+{
+  Session *session = active_session;
+  GList *next_session;
+  gdouble angle;
+  guint key;
+  g_return_val_if_fail (event != NULL, FALSE);
+
+  key = clutter_event_get_key_symbol (event);
+  switch (key)
+    {
+    case CLUTTER_KEY_space:
+      track_video (session);
+      break;
+    case CLUTTER_KEY_plus:
+      set_threshold (100);
+      break;
+    case CLUTTER_KEY_minus:
+      set_threshold (-100);
+      break;
+    case CLUTTER_KEY_s:
+      ENABLE_SMOOTHING = !ENABLE_SMOOTHING;
+      enable_smoothing (ENABLE_SMOOTHING);
+      break;
+    case CLUTTER_KEY_k:
+      if (next_frame (session))
+          paint_frame ();
+      break;
+    case CLUTTER_KEY_j:
+      if (previous_frame (session))
+          paint_frame ();
+      break;
+    case CLUTTER_KEY_r:
+      first_frame (session);
+      paint_frame ();
+      break;
+    case CLUTTER_KEY_t:
+      last_frame (session);
+      paint_frame ();
+      break;
+    case CLUTTER_KEY_o:
+      rotate_video (session, (session->rotation + 1) % 4, session->mirror);
+      break;
+    case CLUTTER_KEY_m:
+      rotate_video (session, session->rotation, ! session->mirror);
+      break;
+    case CLUTTER_KEY_Tab:
+      next_session = g_list_next (g_list_find (session_list, session));
+      if (next_session == NULL)
+        next_session = g_list_first (session_list);
+      set_active_session ((Session *) next_session->data);
+      break;
+    case CLUTTER_KEY_Right:
+      set_smoothing_factor (.05);
+      break;
+    case CLUTTER_KEY_Left:
+      set_smoothing_factor (-.05);
+      break;
+    }
+  set_info_text ();
+  return TRUE;
+}
+
+static gboolean
+on_play_tick (gpointer data)
+{
+  if (! next_frame (active_session))
+    {
+      play_source = 0;
+      set_info_text ();
+      return FALSE;
+    }
+
+  paint_frame ();
+  set_info_text ();
+
+  return TRUE;
+}
+
+static void
+set_playing (gboolean playing, guint fps)
+{
+  if (play_source != 0)
+    {
+      g_source_remove (play_source);
+      play_source = 0;
+    }
+
+  if (playing)
+    play_source = g_timeout_add (1000 / fps, on_play_tick, NULL);
+}
+
+static void
+control_append_joints (GString *reply, Session *session)
+{
+  static const struct
   {
-    g_debug ("Error setting texture area: %s", error->message);
-    g_error_free (error);
-    return FALSE;
-  }
+    SkeltrackJointId id;
+    const gchar *name;
+  } joints[] = {
+    { SKELTRACK_JOINT_ID_HEAD, "head" },
+    { SKELTRACK_JOINT_ID_LEFT_SHOULDER, "left-shoulder" },
+    { SKELTRACK_JOINT_ID_RIGHT_SHOULDER, "right-shoulder" },
+    { SKELTRACK_JOINT_ID_LEFT_ELBOW, "left-elbow" },
+    { SKELTRACK_JOINT_ID_RIGHT_ELBOW, "right-elbow" },
+    { SKELTRACK_JOINT_ID_LEFT_HAND, "left-hand" },
+    { SKELTRACK_JOINT_ID_RIGHT_HAND, "right-hand" }
+  };
+  SkeltrackJointList list = NULL;
+  guint i;
+
+  if (session->current_skeleton != NULL)
+    list = (SkeltrackJointList) session->current_skeleton->data;
+
+  g_string_append_printf (reply, "frame %d\n", session->current_frame_number);
+
+  for (i = 0; i < G_N_ELEMENTS (joints); i++)
+    {
+      SkeltrackJoint *joint = NULL;
 
-  return TRUE;
+      if (list != NULL)
+        joint = skeltrack_joint_list_get_joint (list, joints[i].id);
+
+      if (joint == NULL)
+        {
+          g_string_append_printf (reply, "joint %s none\n", joints[i].name);
+          continue;
+        }
+
+      g_string_append_printf (reply, "joint %s %d %d %d %d %d\n",
+                              joints[i].name,
+                              joint->x,
+                              joint->y,
+                              joint->z,
+                              joint->screen_x,
+                              joint->screen_y);
+    }
 }
 
 static void
-track_video ()
+control_append_stats (GString *reply)
 {
-  GError *error;
-  gint i = 1;
-  GList *frame;
+  gint i;
 
-  g_list_free_full (skeleton_list,
-      (GDestroyNotify) skeltrack_joint_list_free);
+  g_mutex_lock (&stage_counters_lock);
+  for (i = 0; i < STAGE_LAST; i++)
+    {
+      g_string_append_printf (reply,
+                              "stage %s %" G_GINT64_FORMAT
+                              " %" G_GINT64_FORMAT
+                              " %" G_GINT64_FORMAT "\n",
+                              stage_names[i],
+                              stage_counters[i].count,
+                              stage_counters[i].total,
+                              stage_counters[i].max);
+    }
+  g_mutex_unlock (&stage_counters_lock);
+}
 
-  skeleton_list = NULL;
+/* Runs a single command line. Data lines are appended to @reply and
+   the command returns an error message on failure, or NULL. */
+static gchar *
+control_run_command (ControlClient *client, gchar **args, GString *reply)
+{
+  Session *session = active_session;
+  const gchar *command = args[0];
+  guint n_args = g_strv_length (args) - 1;
 
-  for (frame = g_list_first (frame_list);
-       frame != NULL;
-       frame = g_list_next (frame))
+  if (g_strcmp0 (command, "seek") == 0 && n_args == 1)
+    {
+      if (! seek_frame (session, atoi (args[1])))
+        return g_strdup ("frame out of range");
+      paint_frame ();
+    }
+  else if (g_strcmp0 (command, "step") == 0 && n_args <= 1)
     {
+      gint steps = n_args == 1 ? atoi (args[1]) : 1;
+      gboolean moved = FALSE;
 
-      skeleton = SKELTRACK_SKELETON (skeltrack_skeleton_new ());
-      guint16 *depth = (guint16 *) frame->data;
+      for (; steps > 0 && next_frame (session); steps--)
+        moved = TRUE;
+      for (; steps < 0 && previous_frame (session); steps++)
+        moved = TRUE;
 
-      BufferInfo *buffer_info = process_buffer (depth,
-                                                width,
-                                                height,
-                                                dimension_reduction,
-                                                THRESHOLD_BEGIN,
-                                                THRESHOLD_END);
+      if (moved)
+        paint_frame ();
+    }
+  else if (g_strcmp0 (command, "play") == 0 && n_args <= 1)
+    {
+      gint fps = n_args == 1 ? atoi (args[1]) : 30;
+
+      if (fps <= 0 || fps > 1000)
+        return g_strdup ("invalid frame rate");
+      set_playing (TRUE, fps);
+    }
+  else if (g_strcmp0 (command, "pause") == 0 && n_args == 0)
+    {
+      set_playing (FALSE, 0);
+    }
+  else if (g_strcmp0 (command, "threshold") == 0 && n_args == 1)
+    {
+      gint threshold = atoi (args[1]);
 
-      g_printf ("Frame %d: ", i++);
+      if (threshold < THRESHOLD_BEGIN + 300 || threshold > 8000)
+        return g_strdup ("threshold out of range");
+      session->threshold_end = threshold;
+    }
+  else if (g_strcmp0 (command, "smoothing") == 0 && n_args == 1)
+    {
+      if (g_strcmp0 (args[1], "on") != 0 && g_strcmp0 (args[1], "off") != 0)
+        return g_strdup ("smoothing must be on or off");
+      ENABLE_SMOOTHING = g_strcmp0 (args[1], "on") == 0;
+      enable_smoothing (ENABLE_SMOOTHING);
+    }
+  else if (g_strcmp0 (command, "smoothing-factor") == 0 && n_args == 1)
+    {
+      gchar *end;
+      gdouble factor = g_ascii_strtod (args[1], &end);
 
-      SkeltrackJointList pose =
-        skeltrack_skeleton_track_joints_sync (skeleton,
-                                              buffer_info->reduced_buffer,
-                                              buffer_info->reduced_width,
-                                              buffer_info->reduced_height,
-                                              NULL,
-                                              &error);
+      if (end == args[1] || *end != '\0' || ! (factor >= 0 && factor <= 1))
+        return g_strdup ("smoothing factor out of range");
+      set_smoothing_factor (factor - SMOOTHING_FACTOR);
+    }
+  else if (g_strcmp0 (command, "reduction") == 0 && n_args == 1)
+    {
+      gint reduction = atoi (args[1]);
 
-      skeleton_list = g_list_append (skeleton_list, pose);
-      g_object_unref (skeleton);
-      g_printf ("\n");
+      if (reduction < 1 || reduction > MIN (session->width, session->height))
+        return g_strdup ("reduction out of range");
+      session->dimension_reduction = reduction;
+    }
+  else if (g_strcmp0 (command, "rotation") == 0 &&
+           (n_args == 1 || n_args == 2))
+    {
+      Rotation rotation;
+
+      if (! rotation_from_degrees (atoi (args[1]), &rotation))
+        return g_strdup ("rotation must be 0, 90, 180 or 270");
+      if (! rotate_video (session, rotation,
+                          n_args == 2 && g_strcmp0 (args[2], "mirror") == 0))
+        return g_strdup ("cannot rotate while tracking");
+    }
+  else if (g_strcmp0 (command, "track") == 0 && n_args == 0)
+    {
+      track_video (session);
+      if (session->tracking)
+        client->waiting_for = session;
+    }
+  else if (g_strcmp0 (command, "session") == 0 && n_args == 1)
+    {
+      Session *next_session = g_list_nth_data (session_list,
+                                               atoi (args[1]) - 1);
+      if (next_session == NULL)
+        return g_strdup ("no such session");
+      set_active_session (next_session);
+    }
+  else if (g_strcmp0 (command, "joints") == 0 && n_args == 0)
+    {
+      control_append_joints (reply, session);
+    }
+  else if (g_strcmp0 (command, "stats") == 0 && n_args == 0)
+    {
+      control_append_stats (reply);
+    }
+  else if (g_strcmp0 (command, "stats") == 0 && n_args == 1 &&
+           g_strcmp0 (args[1], "reset") == 0)
+    {
+      stage_counters_reset ();
+    }
+#ifdef ENABLE_TRACING
+  else if (g_strcmp0 (command, "trace") == 0 && n_args == 1)
+    {
+      GError *error = NULL;
+      gchar *message;
+
+      if (! trace_enabled)
+        return g_strdup ("tracing is not enabled");
+
+      if (! trace_write (args[1], &error))
+        {
+          message = g_strdup (error->message);
+          g_error_free (error);
+          return message;
+        }
+    }
+#endif
+  else
+    {
+      return g_strdup_printf ("unknown command %s", command);
     }
+
+  return NULL;
 }
 
 static void
-first_frame ()
+control_client_free (ControlClient *client);
+
+static void
+control_client_flush (ControlClient *client);
+
+static gboolean
+on_control_output (GIOChannel *channel,
+                   GIOCondition condition,
+                   gpointer data)
 {
-  current_skeleton = g_list_first (skeleton_list);
-  current_frame = g_list_first (frame_list);
-  current_frame_number = 1;
+  ControlClient *client = (ControlClient *) data;
+
+  control_client_flush (client);
+  if (client->broken)
+    {
+      client->output_watch = 0;
+      control_client_free (client);
+      return FALSE;
+    }
+
+  if (client->output->len == 0)
+    {
+      client->output_watch = 0;
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
+/* Sends as much of the pending output as the socket takes without
+   blocking, and watches for it to drain when some is left. Sending
+   with MSG_NOSIGNAL keeps a client that went away from killing the
+   player with SIGPIPE. */
 static void
-last_frame ()
+control_client_flush (ControlClient *client)
 {
-  current_skeleton = g_list_last (skeleton_list);
-  current_frame = g_list_last (frame_list);
-  current_frame_number = g_list_length (frame_list);
+  gint fd = g_io_channel_unix_get_fd (client->channel);
+  gssize sent;
+
+  while (client->output->len > 0 && ! client->broken)
+    {
+      sent = send (fd, client->output->str, client->output->len,
+                   MSG_NOSIGNAL);
+      if (sent < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            client->broken = TRUE;
+          break;
+        }
+
+      g_string_erase (client->output, 0, sent);
+    }
+
+  if (client->output->len > CONTROL_MAX_OUTPUT)
+    client->broken = TRUE;
+
+  if (client->output->len > 0 && ! client->broken &&
+      client->output_watch == 0)
+    client->output_watch = g_io_add_watch (client->channel,
+                                           G_IO_OUT | G_IO_HUP | G_IO_ERR,
+                                           on_control_output,
+                                           client);
 }
 
-static gboolean
-next_frame ()
+static void
+control_client_write (ControlClient *client, const gchar *text)
 {
-  GList *next_skeleton, *next_frame;
+  g_string_append (client->output, text);
+  control_client_flush (client);
+}
+
+/* Every command answers with its data lines followed by a line that is
+   either "OK" or "ERROR <message>". The answer to "track" is sent once
+   tracking has finished. */
+static void
+control_client_run (ControlClient *client, gchar *line)
+{
+  GString *reply;
+  gchar **args;
+  gchar *error;
+
+  args = g_strsplit_set (g_strstrip (line), " \t", -1);
+  if (args[0] == NULL || args[0][0] == '\0')
+    {
+      g_strfreev (args);
+      return;
+    }
 
-  next_skeleton = g_list_next (current_skeleton);
-  next_frame = g_list_next (current_frame);
+  reply = g_string_new (NULL);
+  error = control_run_command (client, args, reply);
 
-  if (next_skeleton != NULL && next_frame != NULL)
+  if (error != NULL)
     {
-      current_skeleton = next_skeleton;
-      current_frame = next_frame;
-      current_frame_number++;
-      return TRUE;
+      g_string_append_printf (reply, "ERROR %s\n", error);
+      g_free (error);
+    }
+  else if (client->waiting_for == NULL)
+    {
+      g_string_append (reply, "OK\n");
     }
 
-  return FALSE;
+  control_client_write (client, reply->str);
+  set_info_text ();
+
+  g_string_free (reply, TRUE);
+  g_strfreev (args);
 }
 
+/* Runs the buffered commands of @client until there are no complete
+   lines left or one of them has to wait for tracking. Returns FALSE
+   once the client has gone away. */
 static gboolean
-previous_frame ()
+control_client_process (ControlClient *client)
 {
-  GList *previous_skeleton, *previous_frame;
+  GIOStatus status;
+  gchar *line;
 
-  previous_skeleton = g_list_previous (current_skeleton);
-  previous_frame = g_list_previous (current_frame);
-
-  if (previous_skeleton != NULL && previous_frame != NULL)
+  while (client->waiting_for == NULL)
     {
-      current_skeleton = previous_skeleton;
-      current_frame = previous_frame;
-      current_frame_number--;
-      return TRUE;
+      if (client->broken)
+        return FALSE;
+
+      status = g_io_channel_read_line (client->channel, &line,
+                                       NULL, NULL, NULL);
+      if (status == G_IO_STATUS_AGAIN)
+        return TRUE;
+      if (status != G_IO_STATUS_NORMAL)
+        return FALSE;
+
+      control_client_run (client, line);
+      g_free (line);
     }
 
-  return FALSE;
+  return ! client->broken;
 }
 
-static guint16 *
-cut_depth (guint16 *depth, guint threshold_begin, guint threshold_end)
+static void
+control_client_free (ControlClient *client)
 {
-  gint i, j;
-  gint index, value;
+  control_clients = g_list_remove (control_clients, client);
+  if (client->watch != 0)
+    g_source_remove (client->watch);
+  if (client->output_watch != 0)
+    g_source_remove (client->output_watch);
+  g_string_free (client->output, TRUE);
+  g_io_channel_unref (client->channel);
+  g_slice_free (ControlClient, client);
+}
 
-  guint16 *thresholded_depth = g_slice_alloc0 (width * height * sizeof
-      (guint16));
+static gboolean
+on_control_input (GIOChannel *channel,
+                  GIOCondition condition,
+                  gpointer data)
+{
+  ControlClient *client = (ControlClient *) data;
 
-  for (i = 0; i < width; i++)
+  if (! control_client_process (client))
     {
-      for (j = 0; j < height; j++)
-        {
-          index = j * width + i;
-          value = depth[index];
+      client->watch = 0;
+      control_client_free (client);
+      return FALSE;
+    }
 
-          if (value > threshold_end || value < threshold_begin)
-            {
-              thresholded_depth[index] = 0;
-            }
-          else
-            {
-              thresholded_depth[index] = value;
-            }
-        }
+  /* Stop watching while a command is pending so that the unread lines
+     do not keep waking us up */
+  if (client->waiting_for != NULL)
+    {
+      client->watch = 0;
+      return FALSE;
     }
 
-  return thresholded_depth;
+  return TRUE;
 }
 
 static void
-paint_frame ()
+control_notify_tracking_done (Session *session)
 {
-  guint16 *depth;
-  guint16 *thresholded_depth;
-  BufferInfo *buffer_info;
+  GList *clients, *node;
 
-  depth = (guint16 *) current_frame->data;
-
-  thresholded_depth = cut_depth (depth, THRESHOLD_BEGIN, THRESHOLD_END);
+  clients = g_list_copy (control_clients);
+  for (node = clients; node != NULL; node = g_list_next (node))
+    {
+      ControlClient *client = (ControlClient *) node->data;
+      gchar *reply;
+
+      if (client->waiting_for != session)
+        continue;
+
+      client->waiting_for = NULL;
+      reply = g_strdup_printf ("time %" G_GINT64_FORMAT "\n"
+                               "skipped %u\nOK\n",
+                               g_get_monotonic_time () -
+                               session->track_start,
+                               session->skipped_frames);
+      control_client_write (client, reply);
+      g_free (reply);
+
+      if (! control_client_process (client))
+        control_client_free (client);
+      else if (client->waiting_for == NULL)
+        client->watch = g_io_add_watch (client->channel,
+                                        G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                        on_control_input,
+                                        client);
+    }
+  g_list_free (clients);
+}
 
-  guchar *grayscale_buffer = create_grayscale_buffer (thresholded_depth, width, height);
+static gboolean
+on_control_accept (GIOChannel *channel,
+                   GIOCondition condition,
+                   gpointer data)
+{
+  ControlClient *client;
+  gint fd;
 
-  paint_depth (grayscale_buffer, width, height);
+  fd = accept (g_io_channel_unix_get_fd (channel), NULL, NULL);
+  if (fd < 0)
+    {
+      g_debug ("ERROR: %s", g_strerror (errno));
+      return TRUE;
+    }
 
-  g_slice_free1 (sizeof (guchar) * width * height * 3, grayscale_buffer);
+  client = g_slice_new0 (ControlClient);
+  client->channel = g_io_channel_unix_new (fd);
+  client->output = g_string_new (NULL);
+  g_io_channel_set_close_on_unref (client->channel, TRUE);
+  g_io_channel_set_encoding (client->channel, NULL, NULL);
+  g_io_channel_set_flags (client->channel, G_IO_FLAG_NONBLOCK, NULL);
+  client->watch = g_io_add_watch (client->channel,
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  on_control_input,
+                                  client);
 
-  clutter_cairo_texture_invalidate (CLUTTER_CAIRO_TEXTURE (skeleton_tex));
+  control_clients = g_list_append (control_clients, client);
 
-  g_slice_free1 (width * height * sizeof (guint16), thresholded_depth);
+  return TRUE;
 }
 
 static gboolean
-on_key_press (ClutterActor *actor,
-              ClutterEvent *event,
-              gpointer data)
+start_control_socket (const gchar *path)
 {
-  gdouble angle;
-  guint key;
-  guint aux;
-  g_return_val_if_fail (event != NULL, FALSE);
+  struct sockaddr_un address;
+  GIOChannel *channel;
+  gint fd;
 
-  key = clutter_event_get_key_symbol (event);
-  switch (key)
+  if (strlen (path) >= sizeof (address.sun_path))
     {
-    case CLUTTER_KEY_space:
-      track_video ();
-      first_frame ();
-      paint_frame ();
-      break;
-    case CLUTTER_KEY_plus:
-      set_threshold (100);
-      break;
-    case CLUTTER_KEY_minus:
-      set_threshold (-100);
-      break;
-    case CLUTTER_KEY_s:
-      ENABLE_SMOOTHING = !ENABLE_SMOOTHING;
-      enable_smoothing (ENABLE_SMOOTHING);
-      break;
-    case CLUTTER_KEY_k:
-      if (next_frame())
-          paint_frame ();
-      break;
-    case CLUTTER_KEY_j:
-      if (previous_frame())
-          paint_frame ();
-      break;
-    case CLUTTER_KEY_r:
-      first_frame ();
-      paint_frame ();
-      break;
-    case CLUTTER_KEY_t:
-      last_frame ();
-      paint_frame ();
-      break;
-    case CLUTTER_KEY_o:
-      aux = width;
-      width = height;
-      height = aux;
-      set_orientation ();
-      break;
-    case CLUTTER_KEY_Right:
-      set_smoothing_factor (.05);
-      break;
-    case CLUTTER_KEY_Left:
-      set_smoothing_factor (-.05);
-      break;
+      g_print ("Control socket path too long: %s\n", path);
+      return FALSE;
     }
-  set_info_text ();
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      g_print ("Could not create control socket: %s\n", g_strerror (errno));
+      return FALSE;
+    }
+
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &address, sizeof (address)) < 0 ||
+      listen (fd, 4) < 0)
+    {
+      g_print ("Could not listen on %s: %s\n", path, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_channel_set_close_on_unref (channel, TRUE);
+  g_io_add_watch (channel, G_IO_IN, on_control_accept, NULL);
+  g_io_channel_unref (channel);
+
   return TRUE;
 }
 
+static void
+stop_control_socket (void)
+{
+  while (control_clients != NULL)
+    control_client_free ((ControlClient *) control_clients->data);
+
+  if (control_socket_path != NULL)
+    unlink (control_socket_path);
+}
+
 static ClutterActor *
 create_instructions (void)
 {
@@ -732,7 +3010,9 @@ create_instructions (void)
                          "\tRewind:  \t\t\t\tr\n"
                          "\tSet smoothing level:  \t\t\tLeft/Right Arrows\t\t"
                          "\tGo to last frame:   \t\tt\n"
-                         "\tChange orientation:   \t\t\to"
+                         "\tRotate 90 degrees:   \t\t\to\t\t\t\t"
+                         "\tNext recording:   \t\tTab\n"
+                         "\tMirror:   \t\t\t\tm"
                            );
   return text;
 }
@@ -747,6 +3027,8 @@ static void
 init ()
 {
   ClutterActor *stage;
+  gint width = 640;
+  gint height = 480;
 
   stage = clutter_stage_get_default ();
   clutter_stage_set_title (CLUTTER_STAGE (stage), "Skeltrack Video Player");
@@ -775,9 +3057,6 @@ init ()
   skeleton = SKELTRACK_SKELETON (skeltrack_skeleton_new ());
   g_object_get (skeleton, "smoothing-factor", &SMOOTHING_FACTOR, NULL);
 
-  set_orientation ();
-
-  set_info_text ();
   g_signal_connect (skeleton_tex,
                     "draw",
                     G_CALLBACK (on_texture_draw),
@@ -792,20 +3071,92 @@ quit (gint signale)
   clutter_main_quit ();
 }
 
-static void
-free_depth_buffer (guint16 *buffer, gpointer unused)
+static gboolean
+on_info_timeout (gpointer data)
+{
+  set_info_text ();
+  return TRUE;
+}
+
+static gboolean
+parse_max_memory (const gchar *option_name,
+                  const gchar *value,
+                  gpointer data,
+                  GError **error)
 {
-  guint count = width * height * sizeof (guint16);
-  g_slice_free1 (count, buffer);
+  guint64 size;
+  gchar *end;
+
+  size = g_ascii_strtoull (value, &end, 10);
+  switch (g_ascii_toupper (*end))
+    {
+    case 'G':
+      size *= 1024;
+      /* fall through */
+    case 'M':
+      size *= 1024;
+      /* fall through */
+    case 'K':
+      size *= 1024;
+      end++;
+      break;
+    }
+
+  if (end == value || *end != '\0' || size == 0)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Invalid memory size: %s", value);
+      return FALSE;
+    }
+
+  max_memory = size;
+  return TRUE;
 }
 
+static GOptionEntry entries[] =
+{
+  { "control-socket", 'c', 0, G_OPTION_ARG_FILENAME, &control_socket_path,
+    "Accept playback commands on a UNIX socket at PATH", "PATH" },
+  { "max-memory", 'm', 0, G_OPTION_ARG_CALLBACK, parse_max_memory,
+    "Keep frames, renders and poses under SIZE bytes (K, M or G suffix, "
+    "default 256M)", "SIZE" },
+  { "rotation", 'r', 0, G_OPTION_ARG_INT, &rotation_degrees,
+    "Rotate the frames clockwise by DEGREES (0, 90, 180 or 270) unless "
+    "the recording says otherwise", "DEGREES" },
+  { "mirror", 0, 0, G_OPTION_ARG_NONE, &mirror,
+    "Mirror the frames horizontally after rotating them", NULL },
+  { "joint-stream", 'j', 0, G_OPTION_ARG_STRING, &joint_stream_name,
+    "Publish the tracked joints to the POSIX shared memory object NAME",
+    "NAME" },
+#ifdef ENABLE_TRACING
+  { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_path,
+    "Trace the frame pipeline and write it as Chrome trace JSON to FILE "
+    "on exit", "FILE" },
+#endif
+  { NULL }
+};
+
 int
 main (int argc, char *argv[])
 {
-  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
-    return -1;
+  GError *error = NULL;
 
-  gchar *directory;
+  if (clutter_init_with_args (&argc, &argv,
+                              "VIDEO_DIRECTORY [VIDEO_DIRECTORY...] "
+                              "DIMENSION_REDUCTION",
+                              entries, NULL, &error) != CLUTTER_INIT_SUCCESS)
+    {
+      if (error != NULL)
+        {
+          g_print ("%s\n", error->message);
+          g_error_free (error);
+        }
+      return -1;
+    }
+
+  gint dimension_reduction;
+  Rotation rotation;
+  gint i;
 
   init();
 
@@ -813,19 +3164,79 @@ main (int argc, char *argv[])
 
   if (argc < 3)
     {
-      g_print ("Usage: %s VIDEO_DIRECTORY DIMENSION_REDUCTION\n", argv[0]);
+      g_print ("Usage: %s VIDEO_DIRECTORY [VIDEO_DIRECTORY...] "
+               "DIMENSION_REDUCTION\n", argv[0]);
       return 0;
     }
 
-  directory = argv[1];
-  dimension_reduction = atoi(argv[2]);
+  dimension_reduction = atoi(argv[argc - 1]);
+
+  if (! rotation_from_degrees (rotation_degrees, &rotation))
+    {
+      g_print ("Rotation must be 0, 90, 180 or 270 degrees\n");
+      return -1;
+    }
+
+#ifdef ENABLE_TRACING
+  if (trace_path != NULL)
+    trace_init ();
+#endif
+
+  if (joint_stream_name != NULL &&
+      ! joint_stream_open (joint_stream_name, &error))
+    {
+      g_print ("Could not open joint stream: %s\n", error->message);
+      g_clear_error (&error);
+      return -1;
+    }
+
+  init_memory_governor ();
+  init_worker_pool ();
 
-  read_video (directory, width, height, dimension_reduction);
+  for (i = 1; i < argc - 1; i++)
+    {
+      Session *session = session_new (argv[i], dimension_reduction);
+      session->id = i - 1;
+      session->rotation = rotation;
+      session->mirror = mirror;
+      session_load_metadata (session);
+      session_list = g_list_append (session_list, session);
+    }
+
+  set_active_session ((Session *) g_list_first (session_list)->data);
+
+  for (i = 0; i < g_list_length (session_list); i++)
+    read_video ((Session *) g_list_nth_data (session_list, i));
+
+  set_info_text ();
+
+  if (control_socket_path != NULL &&
+      ! start_control_socket (control_socket_path))
+    return -1;
+
+  g_timeout_add_seconds (1, on_info_timeout, NULL);
 
   clutter_main ();
 
-  g_list_free_full (skeleton_list, (GDestroyNotify) skeltrack_joint_list_free);
-  g_list_free_full (frame_list, (GDestroyNotify) free_depth_buffer);
+  set_playing (FALSE, 0);
+  stop_control_socket ();
+
+  g_mutex_lock (&worker_pool.lock);
+  worker_pool.shutting_down = TRUE;
+  g_mutex_unlock (&worker_pool.lock);
+
+  /* Let the pool hand every queued job to run_job, which frees it */
+  g_thread_pool_free (worker_pool.pool, FALSE, TRUE);
+  joint_stream_close ();
+
+#ifdef ENABLE_TRACING
+  if (trace_path != NULL && ! trace_write (trace_path, &error))
+    {
+      g_print ("Could not write trace: %s\n", error->message);
+      g_clear_error (&error);
+    }
+#endif
+  g_list_free_full (session_list, (GDestroyNotify) session_free);
 
   if (skeleton != NULL)
     {
@@ -834,4 +3245,3 @@ main (int argc, char *argv[])
 
   return 0;
 }
-